@@ -106,6 +106,7 @@ enum drbd_read_balancing {
 	RB_256K_STRIPING,
 	RB_512K_STRIPING,
 	RB_1M_STRIPING,
+	RB_LEAST_LATENCY,
 };
 
 /* KEEP the order, do not delete or insert. Only append. */
@@ -343,6 +344,8 @@ enum mdf_flag {
 	MDF_CRASHED_PRIMARY =	1 << 6,
 	MDF_AL_CLEAN =		1 << 7,
 	MDF_AL_DISABLED =       1 << 8,
+	MDF_AL_COMPACT =	1 << 9,
+	MDF_AL_COMPACT_OK =	1 << 10, /* drbdmeta can apply compact AL transactions */
 };
 
 enum mdf_peer_flag {
@@ -369,6 +372,9 @@ enum drbd_uuid_index {
 #define HISTORY_UUIDS_V08 (UI_HISTORY_END - UI_HISTORY_START + 1)
 #define HISTORY_UUIDS DRBD_PEERS_MAX
 
+/* activity log reuse distance histogram, log2 buckets */
+#define DRBD_AL_REUSE_BUCKETS 18
+
 enum drbd_timeout_flag {
 	UT_DEFAULT      = 0,
 	UT_DEGRADED     = 1,
@@ -410,6 +416,9 @@ enum drbd_notification_type {
 /* how I came up with this magic?
  * base64 decode "actlog==" ;) */
 #define DRBD_AL_MAGIC 0x69cb65a2
+/* compact AL transactions; readers that do not know them must not
+ * mistake them for classic ones */
+#define DRBD_AL_COMPACT_MAGIC 0x69cb65a3
 
 /* these are of type "int" */
 #define DRBD_MD_INDEX_INTERNAL -1
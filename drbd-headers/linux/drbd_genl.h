@@ -256,6 +256,10 @@ GENL_struct(DRBD_NLA_DEVICE_STATISTICS, 20, device_statistics,
 	__u64_field(12, 0, dev_current_uuid)
 	__u32_field(13, 0, dev_disk_flags)
 	__bin_field(14, 0, history_uuids, HISTORY_UUIDS * sizeof(__u64))
+	__u32_field(15, 0, dev_al_active)  /* extents in the activity log */
+	__u32_field(16, 0, dev_al_recommended)  /* suggested al-extents, 0: unknown */
+	__u64_field(17, 0, dev_al_reuse_cold)  /* activations of extents not seen recently */
+	__bin_field(18, 0, dev_al_reuse_hist, DRBD_AL_REUSE_BUCKETS * sizeof(__u64))
 )
 
 GENL_struct(DRBD_NLA_CONNECTION_STATISTICS, 21, connection_statistics,
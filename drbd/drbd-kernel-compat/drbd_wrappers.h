@@ -954,12 +954,23 @@ extern void *idr_get_next(struct idr *idp, int *nextidp);
 	})
 #endif
 
+#ifndef lockdep_assert_held
+/* introduced in f607c66 (v2.6.36-rc1) */
+#define lockdep_assert_held(l) do { (void)(l); } while (0)
+#endif
+
 #ifndef list_next_entry
 /* introduced in 008208c (v3.13-rc1) */
 #define list_next_entry(pos, member) \
         list_entry((pos)->member.next, typeof(*(pos)), member)
 #endif
 
+#ifndef list_prev_entry
+/* introduced in 008208c (v3.13-rc1) */
+#define list_prev_entry(pos, member) \
+        list_entry((pos)->member.prev, typeof(*(pos)), member)
+#endif
+
 /*
  * Introduced in 930631ed (v2.6.19-rc1).
  */
@@ -1228,6 +1239,12 @@ static inline u32 prandom_u32(void)
 	list_entry((ptr)->next, type, member)
 #endif
 
+#ifndef list_last_entry
+/* introduced in 93be3c2 (v3.13-rc1) */
+#define list_last_entry(ptr, type, member) \
+	list_entry((ptr)->prev, type, member)
+#endif
+
 #ifndef list_first_entry_or_null
 #define list_first_entry_or_null(ptr, type, member) \
 	(!list_empty(ptr) ? list_first_entry(ptr, type, member) : NULL)
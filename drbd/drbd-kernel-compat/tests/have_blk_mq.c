@@ -0,0 +1,23 @@
+#include <linux/blk-mq.h>
+
+/* With commit 74c45052 (Linux-4.0), ->queue_rq() gets a struct blk_mq_queue_data,
+ * and blk_mq_end_io() became blk_mq_end_request() in c8a446ad (Linux-4.0).
+ * We only support this version of the blk-mq interface.
+ */
+
+int drbd_queue_rq(struct blk_mq_hw_ctx *hctx, const struct blk_mq_queue_data *bd)
+{
+	blk_mq_start_request(bd->rq);
+	blk_mq_end_request(bd->rq, 0);
+	return BLK_MQ_RQ_QUEUE_OK;
+}
+
+struct blk_mq_ops drbd_mq_ops = {
+	.queue_rq	= drbd_queue_rq,
+};
+
+int foo(struct blk_mq_tag_set *set)
+{
+	set->ops = &drbd_mq_ops;
+	return blk_mq_alloc_tag_set(set);
+}
@@ -0,0 +1,9 @@
+#include <linux/blk-mq.h>
+
+/* With commit 6a83e74d (Linux-4.9), BLK_MQ_F_BLOCKING lets ->queue_rq() sleep.
+ * Before that, it may be called with preemption disabled. */
+
+void foo(struct blk_mq_tag_set *set)
+{
+	set->flags |= BLK_MQ_F_BLOCKING;
+}
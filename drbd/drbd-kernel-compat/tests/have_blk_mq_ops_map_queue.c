@@ -0,0 +1,7 @@
+#include <linux/blk-mq.h>
+
+/* blk_mq_ops.map_queue was removed with commit 7d7e0f90 (Linux-4.8). */
+
+struct blk_mq_ops drbd_mq_ops = {
+	.map_queue	= blk_mq_map_queue,
+};
@@ -0,0 +1,23 @@
+#include <linux/blkdev.h>
+#include <linux/pmem.h>
+
+/* With Linux-4.2, bdev_direct_access() returns a void __pmem * mapping of a
+ * DAX capable block device, and <linux/pmem.h> has memcpy_to_pmem() and
+ * wmb_pmem() to make CPU stores to it durable.
+ */
+
+long foo(struct block_device *bdev, sector_t sector, void *buf)
+{
+	void __pmem *addr;
+	unsigned long pfn;
+	long avail;
+
+	if (!arch_has_pmem_api())
+		return -EOPNOTSUPP;
+	avail = bdev_direct_access(bdev, sector, &addr, &pfn, 4096);
+	if (avail < 4096)
+		return avail;
+	memcpy_to_pmem(addr, buf, 4096);
+	wmb_pmem();
+	return 0;
+}
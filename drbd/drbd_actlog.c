@@ -28,11 +28,16 @@
 #include <linux/drbd.h>
 #include <linux/drbd_limits.h>
 #include <linux/dynamic_debug.h>
+#include <linux/hash.h>
+#ifdef COMPAT_HAVE_DAX_PMEM
+#include <linux/pmem.h>
+#endif
 #include "drbd_int.h"
 #include "drbd_wrappers.h"
 
 enum al_transaction_types {
 	AL_TR_UPDATE = 0,
+	AL_TR_COMPACT = 1,
 	AL_TR_INITIALIZED = 0xffff
 };
 /* all fields on disc in big endian */
@@ -92,20 +97,55 @@ struct __packed al_transaction_on_disk {
 	__be32	context[AL_CONTEXT_PER_TRANSACTION];
 };
 
+/* Same header, but the update and context slots share one variable sized
+ * payload.  Written only if MDF_AL_COMPACT is set in the super block, with
+ * DRBD_AL_COMPACT_MAGIC, so that readers not knowing it skip these blocks.
+ *
+ * An update is the big endian 16 bit slot number followed by the extent
+ * number, as zigzag encoded delta to the extent number of the previous
+ * update (starting with 0), 7 bit per byte, least significant first,
+ * high bit set on all but the last byte.
+ * The context starts at the first 4 byte aligned offset after the updates,
+ * n_context big endian 32 bit extent numbers. */
+struct __packed al_compact_transaction_on_disk {
+	__be32	magic;
+	__be32	tr_number;
+	__be32	crc32c;
+	__be16	transaction_type;	/* AL_TR_COMPACT */
+	__be16	n_updates;
+	__be16	context_size;
+	__be16	context_start_slot_nr;
+
+	/* number of context slots in this transaction */
+	__be16	n_context;
+
+	/* bytes used by the encoded updates */
+	__be16	updates_bytes;
+
+	__be32	__reserved[3];
+
+	/* --- 36 byte used --- */
+
+	u8	payload[4096 - 36];
+};
+
 struct update_peers_work {
        struct drbd_work w;
        struct drbd_peer_device *peer_device;
        unsigned int enr;
 };
 
-void *drbd_md_get_buffer(struct drbd_device *device, const char *intent)
+/* See enum drbd_md_io_buffer for which buffer to use, and in which order. */
+void *drbd_md_get_buffer(struct drbd_device *device, enum drbd_md_io_buffer which,
+			 const char *intent)
 {
+	struct drbd_md_io *md_io = &device->md_io[which];
 	int r;
 	long t;
 
 	do {
 		t = wait_event_timeout(device->misc_wait,
-				(r = atomic_cmpxchg(&device->md_io.in_use, 0, 1)) == 0 ||
+				(r = atomic_cmpxchg(&md_io->in_use, 0, 1)) == 0 ||
 				device->disk_state[NOW] <= D_FAILED,
 				HZ * 10);
 
@@ -118,15 +158,15 @@ void *drbd_md_get_buffer(struct drbd_device *device, const char *intent)
 	if (r)
 		return NULL;
 
-	device->md_io.current_use = intent;
-	device->md_io.start_jif = jiffies;
-	device->md_io.submit_jif = device->md_io.start_jif - 1;
-	return page_address(device->md_io.page);
+	md_io->current_use = intent;
+	md_io->start_jif = jiffies;
+	md_io->submit_jif = md_io->start_jif - 1;
+	return page_address(md_io->page);
 }
 
-void drbd_md_put_buffer(struct drbd_device *device)
+void drbd_md_put_buffer(struct drbd_device *device, enum drbd_md_io_buffer which)
 {
-	if (atomic_dec_and_test(&device->md_io.in_use))
+	if (atomic_dec_and_test(&device->md_io[which].in_use))
 		wake_up(&device->misc_wait);
 }
 
@@ -150,33 +190,34 @@ void wait_until_done_or_force_detached(struct drbd_device *device, struct drbd_b
 	}
 }
 
-static int _drbd_md_sync_page_io(struct drbd_device *device,
-				 struct drbd_backing_dev *bdev,
-				 sector_t sector, int rw)
+static int md_io_rw(struct drbd_device *device, int rw)
+{
+	if ((rw & WRITE) && !test_bit(MD_NO_BARRIER, &device->flags))
+		rw |= DRBD_REQ_FUA | DRBD_REQ_FLUSH;
+	return rw | DRBD_REQ_UNPLUG | DRBD_REQ_SYNC | REQ_NOIDLE;
+}
+
+/* Submits the md_io page, and returns the bio in *bio_p.
+ * Wait for it with _drbd_md_wait_page_io(). */
+static int _drbd_md_submit_page_io(struct drbd_device *device,
+				   struct drbd_backing_dev *bdev, struct drbd_md_io *md_io,
+				   sector_t sector, int rw, struct bio **bio_p)
 {
 	struct bio *bio;
 	/* we do all our meta data IO in aligned 4k blocks. */
 	const int size = 4096;
 	int err;
 
-	if ((rw & WRITE) && !test_bit(MD_NO_BARRIER, &device->flags))
-		rw |= DRBD_REQ_FUA | DRBD_REQ_FLUSH;
-	rw |= DRBD_REQ_UNPLUG | DRBD_REQ_SYNC | REQ_NOIDLE;
-
-#ifndef REQ_FLUSH
-	/* < 2.6.36, "barrier" semantic may fail with EOPNOTSUPP */
- retry:
-#endif
-	device->md_io.done = 0;
-	device->md_io.error = -ENODEV;
+	md_io->done = 0;
+	md_io->error = -ENODEV;
 
 	bio = bio_alloc_drbd(GFP_NOIO);
 	bio->bi_bdev = bdev->md_bdev;
 	DRBD_BIO_BI_SECTOR(bio) = sector;
 	err = -EIO;
-	if (bio_add_page(bio, device->md_io.page, size, 0) != size)
+	if (bio_add_page(bio, md_io->page, size, 0) != size)
 		goto out;
-	bio->bi_private = device;
+	bio->bi_private = md_io;
 	bio->bi_end_io = drbd_md_endio;
 	bio->bi_rw = rw;
 
@@ -191,21 +232,55 @@ static int _drbd_md_sync_page_io(struct drbd_device *device,
 	}
 
 	bio_get(bio); /* one bio_put() is in the completion handler */
-	atomic_inc(&device->md_io.in_use); /* drbd_md_put_buffer() is in the completion handler */
-	device->md_io.submit_jif = jiffies;
+	atomic_inc(&md_io->in_use); /* drbd_md_put_buffer() is in the completion handler */
+	md_io->submit_jif = jiffies;
 	if (drbd_insert_fault(device, (rw & WRITE) ? DRBD_FAULT_MD_WR : DRBD_FAULT_MD_RD))
 		bio_endio(bio, -EIO);
 	else
 		submit_bio(rw, bio);
-	wait_until_done_or_force_detached(device, bdev, &device->md_io.done);
+	*bio_p = bio;
+	return 0;
+ out:
+	bio_put(bio);
+	return err;
+}
+
+/* Waits for a bio from _drbd_md_submit_page_io(); the caller still has to bio_put() it. */
+static int _drbd_md_wait_page_io(struct drbd_device *device,
+				 struct drbd_backing_dev *bdev, struct drbd_md_io *md_io,
+				 struct bio *bio)
+{
+	int err = -EIO;
+
+	wait_until_done_or_force_detached(device, bdev, &md_io->done);
 	if (bio_flagged(bio, BIO_UPTODATE))
-		err = device->md_io.error;
+		err = md_io->error;
+	return err;
+}
+
+static int _drbd_md_sync_page_io(struct drbd_device *device,
+				 struct drbd_backing_dev *bdev, struct drbd_md_io *md_io,
+				 sector_t sector, int rw)
+{
+	struct bio *bio;
+	int err;
+
+	rw = md_io_rw(device, rw);
+
+#ifndef REQ_FLUSH
+	/* < 2.6.36, "barrier" semantic may fail with EOPNOTSUPP */
+ retry:
+#endif
+	err = _drbd_md_submit_page_io(device, bdev, md_io, sector, rw, &bio);
+	if (err)
+		return err;
+	err = _drbd_md_wait_page_io(device, bdev, md_io, bio);
 
 #ifndef REQ_FLUSH
 	/* check for unsupported barrier op.
 	 * would rather check on EOPNOTSUPP, but that is not reliable.
 	 * don't try again for ANY return value != 0 */
-	if (err && device->md_io.done && (bio->bi_rw & DRBD_REQ_HARDBARRIER)) {
+	if (err && md_io->done && (bio->bi_rw & DRBD_REQ_HARDBARRIER)) {
 		/* Try again with no barrier */
 		drbd_warn(device, "Barriers not supported on meta data device - disabling\n");
 		set_bit(MD_NO_BARRIER, &device->flags);
@@ -214,16 +289,16 @@ static int _drbd_md_sync_page_io(struct drbd_device *device,
 		goto retry;
 	}
 #endif
- out:
 	bio_put(bio);
 	return err;
 }
 
 int drbd_md_sync_page_io(struct drbd_device *device, struct drbd_backing_dev *bdev,
-			 sector_t sector, int rw)
+			 enum drbd_md_io_buffer which, sector_t sector, int rw)
 {
+	struct drbd_md_io *md_io = &device->md_io[which];
 	int err;
-	D_ASSERT(device, atomic_read(&device->md_io.in_use) == 1);
+	D_ASSERT(device, atomic_read(&md_io->in_use) == 1);
 
 	if (!bdev->md_bdev) {
 		if (drbd_ratelimit())
@@ -242,7 +317,7 @@ int drbd_md_sync_page_io(struct drbd_device *device, struct drbd_backing_dev *bd
 		     current->comm, current->pid, __func__,
 		     (unsigned long long)sector, (rw & WRITE) ? "WRITE" : "READ");
 
-	err = _drbd_md_sync_page_io(device, bdev, sector, rw);
+	err = _drbd_md_sync_page_io(device, bdev, md_io, sector, rw);
 	if (err) {
 		drbd_err(device, "drbd_md_sync_page_io(,%llus,%s) failed with error %d\n",
 		    (unsigned long long)sector, (rw & WRITE) ? "WRITE" : "READ", err);
@@ -250,6 +325,36 @@ int drbd_md_sync_page_io(struct drbd_device *device, struct drbd_backing_dev *bd
 	return err;
 }
 
+static unsigned int al_updates_per_transaction(struct drbd_backing_dev *bdev)
+{
+	return bdev->md.flags & MDF_AL_COMPACT ?
+		AL_COMPACT_UPDATES_PER_TRANSACTION : AL_UPDATES_PER_TRANSACTION;
+}
+
+/**
+ * drbd_al_tr_per_commit() - Number of transactions one commit may write
+ * @bdev:	Backing device.
+ *
+ * One per AL stripe, up to AL_TR_PER_COMMIT_MAX.  Leave at least half of
+ * the on-disk ring buffer to the previous commits.
+ */
+unsigned int drbd_al_tr_per_commit(struct drbd_backing_dev *bdev)
+{
+#ifdef REQ_FLUSH
+	unsigned int n = min_t(unsigned int, bdev->md.al_stripes, AL_TR_PER_COMMIT_MAX);
+
+	return clamp_t(unsigned int, bdev->md.al_size_4k / 2, 1, n);
+#else
+	/* < 2.6.36, the barrier fallback only works synchronously */
+	return 1;
+#endif
+}
+
+unsigned int drbd_al_max_pending_changes(struct drbd_backing_dev *bdev)
+{
+	return al_updates_per_transaction(bdev) * drbd_al_tr_per_commit(bdev);
+}
+
 static struct bm_extent*
 find_active_resync_extent(struct drbd_device *device, struct drbd_peer_device *except,
 			  unsigned int enr)
@@ -298,6 +403,145 @@ set_bme_priority(struct drbd_device *device, struct drbd_peer_device *except,
 	return wake;
 }
 
+/*
+ * Working set telemetry.
+ *
+ * Whenever an AL extent becomes idle (refcnt drops to zero), it is stamped
+ * with a sequence number.  When it is activated again later, the number of
+ * extents that became idle in between, plus the ones in use right now,
+ * is about the size the activity log needs to have for that to be a hit.
+ * Extents evicted from the activity log are remembered in a small "ghost"
+ * table, so we also learn how much larger it would need to be.
+ *
+ * All of this is protected by the al_lock.
+ */
+#define AL_REUSE_PERIOD 4096	/* activations per recommendation */
+#define AL_REUSE_MISS_PERMILLE 10	/* tolerated reactivations that miss */
+
+static struct al_ghost *al_ghost_slot(struct drbd_device *device, unsigned int enr)
+{
+	return device->al_reuse.ghost + hash_32(enr, AL_GHOST_BITS);
+}
+
+static void al_ghost_add(struct drbd_device *device, struct lc_element *e)
+{
+	struct al_ghost *g;
+
+	if (!device->al_reuse.ghost || e->lc_number == LC_FREE)
+		return;
+	g = al_ghost_slot(device, e->lc_number);
+	g->enr = e->lc_number;
+	g->idle_since = lc_entry(e, struct al_extent, lce)->idle_since;
+}
+
+static void al_update_recommendation(struct drbd_device *device)
+{
+	struct drbd_al_reuse *r = &device->al_reuse;
+	struct lru_cache *al = device->act_log;
+	u64 total = 0, beyond;
+	unsigned int recommended = 0;
+	int b;
+
+	for (b = 0; b < DRBD_AL_REUSE_BUCKETS; b++)
+		total += r->hist[b];
+
+	/* Mostly cold activations (e.g. a sequential stream) tell us nothing
+	 * about the working set.  Don't shrink because of them. */
+	if (total >= AL_REUSE_PERIOD / 64) {
+		beyond = total;
+		for (b = 0; b < DRBD_AL_REUSE_BUCKETS; b++) {
+			beyond -= r->hist[b];
+			if (beyond * 1000 <= total * AL_REUSE_MISS_PERMILLE) {
+				/* all of bucket b needed less than 1 << b */
+				recommended = 1U << b;
+				break;
+			}
+		}
+		recommended = clamp_t(unsigned int, recommended,
+				      DRBD_AL_EXTENTS_MIN, DRBD_AL_EXTENTS_MAX);
+	}
+	r->recommended = recommended;
+
+	if (al_autosize && recommended)
+		al->max_active = min(recommended, al->nr_elements);
+	else if (!al_autosize)
+		al->max_active = al->nr_elements;
+
+	/* age the history, so we follow changes of the workload */
+	for (b = 0; b < DRBD_AL_REUSE_BUCKETS; b++)
+		r->hist[b] >>= 1;
+	r->cold >>= 1;
+	r->activations = 0;
+}
+
+/* @al_ext was just returned by lc_get() and friends for @enr */
+static void al_account_get(struct drbd_device *device, struct lc_element *al_ext, unsigned int enr)
+{
+	struct drbd_al_reuse *r = &device->al_reuse;
+	unsigned int idle_since;
+
+	if (al_ext->refcnt != 1)
+		return; /* was in use already */
+
+	if (al_ext->lc_number == enr) {
+		idle_since = lc_entry(al_ext, struct al_extent, lce)->idle_since;
+	} else {
+		struct al_ghost *g;
+
+		/* about to evict its old label */
+		al_ghost_add(device, al_ext);
+		g = r->ghost ? al_ghost_slot(device, enr) : NULL;
+		if (!g || g->enr != enr) {
+			r->cold++;
+			goto out;
+		}
+		idle_since = g->idle_since;
+		g->enr = LC_FREE;
+	}
+	r->hist[min(fls(r->idle_seq - idle_since + device->act_log->used),
+		    DRBD_AL_REUSE_BUCKETS - 1)]++;
+out:
+	if (++r->activations >= AL_REUSE_PERIOD)
+		al_update_recommendation(device);
+}
+
+static void al_account_put(struct drbd_device *device, struct lc_element *al_ext)
+{
+	lc_entry(al_ext, struct al_extent, lce)->idle_since = ++device->al_reuse.idle_seq;
+}
+
+/* With al_autosize, give back AL extents beyond the measured working set.
+ * Only use update slots of a transaction that is written anyway, and
+ * at most as many as are used for activations already. */
+static void al_shrink_piggyback(struct drbd_device *device)
+{
+	struct lru_cache *al = device->act_log;
+	unsigned int per_tr = al_updates_per_transaction(device->ldev);
+	unsigned int n;
+
+	spin_lock_irq(&device->al_lock);
+	n = min(al->pending_changes, roundup(al->pending_changes, per_tr) - al->pending_changes);
+	for (; n; n--) {
+		struct lc_element *al_ext = lc_shrink(al);
+
+		if (!al_ext)
+			break;
+		al_ghost_add(device, al_ext);
+	}
+	spin_unlock_irq(&device->al_lock);
+}
+
+/* Nothing pending, and no transaction in flight either */
+static bool al_committed(struct lru_cache *al)
+{
+	return al->pending_changes == 0 && !test_bit(__LC_COMMITTING, &al->flags);
+}
+
+static bool al_commit_in_flight(struct lru_cache *al)
+{
+	return test_bit(__LC_COMMITTING, &al->flags);
+}
+
 static
 struct lc_element *_al_get(struct drbd_device *device, unsigned int enr, bool nonblock)
 {
@@ -318,10 +562,134 @@ struct lc_element *_al_get(struct drbd_device *device, unsigned int enr, bool no
 		al_ext = lc_try_get(device->act_log, enr);
 	else
 		al_ext = lc_get(device->act_log, enr);
+	if (al_ext)
+		al_account_get(device, al_ext, enr);
 	spin_unlock_irq(&device->al_lock);
 	return al_ext;
 }
 
+/* Note where this write ends.  Returns true if it continues the previous
+ * one, and the extents ahead of it have not been activated yet.
+ * Unlocked, the fast path only keeps track of the stream. */
+static bool al_seq_write(struct drbd_device *device, struct drbd_interval *i, unsigned int last)
+{
+	unsigned int n = min_t(unsigned int, al_prefetch_extents, AL_PREFETCH_MAX);
+	bool sequential;
+
+	if (!n)
+		return false;
+	sequential = ACCESS_ONCE(device->al_seq_next) == i->sector;
+	ACCESS_ONCE(device->al_seq_next) = i->sector + (i->size >> 9);
+	return sequential && ACCESS_ONCE(device->al_prefetched) != last + n;
+}
+
+/* Activate the extents after @last, in the transaction a sequential writer
+ * needs anyways to enter extent @last; see drbd_al_begin_io_nonblock().
+ * This never causes a transaction of its own.  Called with the al_lock held.
+ * The references are held until the transaction is committed,
+ * see drbd_al_prefetch_release(). */
+static void al_prefetch_locked(struct drbd_device *device, unsigned int last)
+{
+	struct lru_cache *al = device->act_log;
+	unsigned int n = min_t(unsigned int, al_prefetch_extents, AL_PREFETCH_MAX);
+	sector_t capacity = drbd_get_capacity(device->this_bdev);
+	unsigned int enr;
+
+	device->al_prefetched = last + n;
+	for (enr = last + 1; enr <= last + n; enr++) {
+		struct lc_element *al_ext;
+
+		if ((sector_t)enr << (AL_EXTENT_SHIFT-9) >= capacity)
+			break;
+		if (lc_find(al, enr) || lc_is_used(al, enr))
+			continue;
+		/* Do not take the last unused elements, or update slots,
+		 * away from real writers, and don't compete with resync. */
+		if (device->al_prefetch_held_nr == AL_PREFETCH_MAX ||
+		    al->used + 1 >= al->nr_elements ||
+		    al->pending_changes + 1 >= al->max_pending_changes ||
+		    find_active_resync_extent(device, NULL, enr))
+			break;
+		al_ext = lc_get(al, enr);
+		if (!al_ext)
+			break;
+		al_account_get(device, al_ext, enr);
+		device->al_prefetch_held[device->al_prefetch_held_nr++] = al_ext;
+	}
+}
+
+/**
+ * drbd_al_prefetch_release() - Drop the references of committed prefetched extents
+ * @device:	DRBD device.
+ *
+ * They stay in the active set, as most recently used.
+ */
+void drbd_al_prefetch_release(struct drbd_device *device)
+{
+	struct lru_cache *al = device->act_log;
+	unsigned int i, kept = 0;
+	bool wake = false;
+
+	/* only the submitter changes al_prefetch_held_nr */
+	if (!device->al_prefetch_held_nr)
+		return;
+
+	spin_lock_irq(&device->al_lock);
+	for (i = 0; i < device->al_prefetch_held_nr; i++) {
+		struct lc_element *al_ext = device->al_prefetch_held[i];
+
+		if (al_ext->lc_number != al_ext->lc_new_number) {
+			device->al_prefetch_held[kept++] = al_ext;
+			continue;
+		}
+		if (lc_put(al, al_ext) == 0) {
+			al_account_put(device, al_ext);
+			wake = true;
+		}
+	}
+	device->al_prefetch_held_nr = kept;
+	spin_unlock_irq(&device->al_lock);
+	if (wake)
+		wake_up(&device->al_wait);
+}
+
+/* Most writes go to an extent that is in use by other writes already.
+ * Take a reference on it without the al_lock, if possible. */
+static struct lc_element *_al_get_lockless(struct drbd_device *device, unsigned int enr)
+{
+	struct drbd_peer_device *peer_device;
+	struct lc_element *al_ext;
+	bool resync_active = false;
+
+	/* Active resync extents may block application writes (BME_NO_WRITES),
+	 * and can only be checked under the al_lock.  Don't bypass it while
+	 * there are any.  Racy, but the resync side still waits for the
+	 * refcnt of the AL extent to drop to zero, we just would not give it
+	 * priority. */
+	rcu_read_lock();
+	for_each_peer_device_rcu(peer_device, device) {
+		if (ACCESS_ONCE(peer_device->resync_lru->used)) {
+			resync_active = true;
+			break;
+		}
+	}
+	rcu_read_unlock();
+	if (resync_active)
+		return NULL;
+
+	al_ext = lc_try_get_lockless(device->act_log, enr);
+	if (al_ext && al_ext->lc_new_number != enr) {
+		/* lost a race with recycling of that element */
+		spin_lock_irq(&device->al_lock);
+		if (lc_put(device->act_log, al_ext) == 0)
+			al_account_put(device, al_ext);
+		spin_unlock_irq(&device->al_lock);
+		wake_up(&device->al_wait);
+		al_ext = NULL;
+	}
+	return al_ext;
+}
+
 bool drbd_al_begin_io_fastpath(struct drbd_device *device, struct drbd_interval *i)
 {
 	/* for bios crossing activity log extent boundaries,
@@ -338,7 +706,15 @@ bool drbd_al_begin_io_fastpath(struct drbd_device *device, struct drbd_interval
 	if (first != last)
 		return false;
 
-	fastpath_ok = _al_get(device, first, true);
+	if (_al_get_lockless(device, first))
+		fastpath_ok = true;
+	else
+		fastpath_ok = _al_get(device, first, true);
+
+	/* The next extent is activated with the transaction the writer
+	 * needs to get there, see drbd_al_begin_io_nonblock(). */
+	if (fastpath_ok)
+		al_seq_write(device, i, first);
 	return fastpath_ok;
 }
 
@@ -366,7 +742,13 @@ bool drbd_al_begin_io_prepare(struct drbd_device *device, struct drbd_interval *
 	for (enr = first; enr <= last; enr++) {
 		struct lc_element *al_ext;
 		wait_event(device->al_wait,
-				(al_ext = _al_get(device, enr, false)) != NULL);
+				(al_ext = _al_get(device, enr, false)) != NULL ||
+				al_commit_in_flight(device->act_log));
+		if (!al_ext) {
+			drbd_al_commit_wait(device);
+			enr--;
+			continue;
+		}
 		if (al_ext->lc_number != enr)
 			need_transaction = true;
 	}
@@ -374,44 +756,193 @@ bool drbd_al_begin_io_prepare(struct drbd_device *device, struct drbd_interval *
 }
 
 static int al_write_transaction(struct drbd_device *device);
+static int al_group_write_transaction(struct drbd_device *device);
+static int al_prepare_transaction(struct drbd_device *device, sector_t *sector);
+static void al_end_transaction(struct drbd_device *device, bool written, int err);
+static int al_write_dax(struct drbd_device *device, void *buffer, sector_t sector);
+static int al_write_transactions(struct drbd_device *device);
 static int bm_e_weight(struct drbd_peer_device *peer_device, unsigned long enr);
 
 void drbd_al_begin_io_commit(struct drbd_device *device)
 {
+	struct lru_cache *al = device->act_log;
 	bool locked = false;
 
 	/* Serialize multiple transactions.
 	 * This uses test_and_set_bit, memory barrier is implicit.
+	 * Help finishing a pipelined transaction of the submitter,
+	 * instead of depending on the submitter making progress.
 	 */
-	wait_event(device->al_wait,
-			device->act_log->pending_changes == 0 ||
-			(locked = lc_try_lock_for_transaction(device->act_log)));
+	for (;;) {
+		wait_event(device->al_wait,
+				al_committed(al) || al_commit_in_flight(al) ||
+				(locked = lc_try_lock_for_transaction(al)));
+		if (locked || !al_commit_in_flight(al))
+			break;
+		drbd_al_commit_wait(device);
+	}
 
 	if (locked) {
 		/* Double check: it may have been committed by someone else
 		 * while we were waiting for the lock. */
-		if (device->act_log->pending_changes) {
+		if (al->pending_changes) {
 			bool write_al_updates;
 
 			rcu_read_lock();
 			write_al_updates = rcu_dereference(device->ldev->disk_conf)->al_updates;
 			rcu_read_unlock();
 
-			if (write_al_updates)
-				al_write_transaction(device);
+			if (write_al_updates) {
+				al_shrink_piggyback(device);
+				if (al->pending_changes > al_updates_per_transaction(device->ldev))
+					al_write_transactions(device);
+				else if (al_group_commit)
+					al_group_write_transaction(device);
+				else
+					al_write_transaction(device);
+			}
 			spin_lock_irq(&device->al_lock);
 			/* FIXME
 			if (err)
 				we need an "lc_cancel" here;
 			*/
-			lc_committed(device->act_log);
+			lc_committed(al);
 			spin_unlock_irq(&device->al_lock);
 		}
-		lc_unlock(device->act_log);
+		lc_unlock(al);
 		wake_up(&device->al_wait);
 	}
 }
 
+/**
+ * drbd_al_commit_start() - Start writing an activity log transaction
+ * @device:	DRBD device.
+ *
+ * Pipelined variant of drbd_al_begin_io_commit(), used by the submitter.
+ * Returns true if a transaction is now in flight; the caller then has to
+ * call drbd_al_commit_wait() before it uses the extents it was for.
+ * In the meantime, changes for the next transaction may be accumulated.
+ * No transaction can start before this one completed, so transactions
+ * still reach the disk in order of al_tr_number.
+ */
+#ifdef REQ_FLUSH
+bool drbd_al_commit_start(struct drbd_device *device)
+{
+	struct lru_cache *al = device->act_log;
+	struct bio *bio = NULL;
+	bool write_al_updates;
+	sector_t sector;
+	bool locked = false;
+	int err;
+
+	if (al_group_commit) {
+		drbd_al_begin_io_commit(device);
+		return false;
+	}
+
+	for (;;) {
+		wait_event(device->al_wait,
+				al_committed(al) || al_commit_in_flight(al) ||
+				(locked = lc_try_lock_for_transaction(al)));
+		if (locked || !al_commit_in_flight(al))
+			break;
+		drbd_al_commit_wait(device);
+	}
+	if (!locked)
+		return false;
+
+	if (!al->pending_changes) {
+		lc_unlock(al);
+		wake_up(&device->al_wait);
+		return false;
+	}
+
+	rcu_read_lock();
+	write_al_updates = rcu_dereference(device->ldev->disk_conf)->al_updates;
+	rcu_read_unlock();
+
+	if (write_al_updates)
+		al_shrink_piggyback(device);
+
+	/* too large for one transaction, written synchronously */
+	if (write_al_updates &&
+	    al->pending_changes > al_updates_per_transaction(device->ldev)) {
+		al_write_transactions(device);
+		write_al_updates = false;
+	}
+
+	if (write_al_updates && !al_prepare_transaction(device, &sector)) {
+		err = al_write_dax(device, page_address(device->md_io[DRBD_MD_IO_AL].page), sector);
+		if (err == -EOPNOTSUPP) {
+			err = _drbd_md_submit_page_io(device, device->ldev,
+						      &device->md_io[DRBD_MD_IO_AL], sector,
+						      md_io_rw(device, WRITE), &bio);
+			if (err)
+				bio = NULL;
+		}
+		if (!bio)
+			al_end_transaction(device, true, err ? -EIO : 0);
+	}
+
+	spin_lock_irq(&device->al_lock);
+	if (bio) {
+		device->al_commit_bio = bio;
+		lc_start_commit(al);
+	} else {
+		/* nothing in flight, done already */
+		lc_committed(al);
+	}
+	spin_unlock_irq(&device->al_lock);
+	lc_unlock(al);
+	wake_up(&device->al_wait);
+	return bio != NULL;
+}
+
+/**
+ * drbd_al_commit_wait() - Wait for the transaction from drbd_al_commit_start()
+ * @device:	DRBD device.
+ *
+ * Whoever comes first waits for the meta data write and finishes the
+ * transaction; everyone else waits for that to happen.
+ */
+void drbd_al_commit_wait(struct drbd_device *device)
+{
+	struct bio *bio;
+	int err;
+
+	spin_lock_irq(&device->al_lock);
+	bio = device->al_commit_bio;
+	device->al_commit_bio = NULL;
+	spin_unlock_irq(&device->al_lock);
+
+	if (!bio) {
+		wait_event(device->al_wait, !al_commit_in_flight(device->act_log));
+		return;
+	}
+
+	err = _drbd_md_wait_page_io(device, device->ldev, &device->md_io[DRBD_MD_IO_AL], bio);
+	bio_put(bio);
+	al_end_transaction(device, true, err ? -EIO : 0);
+
+	spin_lock_irq(&device->al_lock);
+	/* FIXME as in drbd_al_begin_io_commit(), errors are not undone */
+	lc_finish_commit(device->act_log);
+	spin_unlock_irq(&device->al_lock);
+	wake_up(&device->al_wait);
+}
+#else
+/* < 2.6.36: the barrier fallback in _drbd_md_sync_page_io() needs to be synchronous */
+bool drbd_al_commit_start(struct drbd_device *device)
+{
+	drbd_al_begin_io_commit(device);
+	return false;
+}
+
+void drbd_al_commit_wait(struct drbd_device *device)
+{
+}
+#endif
+
 /*
  * @delegate:	delegate activity log I/O to the worker thread
  */
@@ -439,6 +970,8 @@ struct lc_element *_al_get_for_peer(struct drbd_peer_device *peer_device, unsign
 		return NULL;
 	}
 	al_ext = lc_get(device->act_log, enr);
+	if (al_ext)
+		al_account_get(device, al_ext, enr);
 	spin_unlock_irq(&device->al_lock);
 	return al_ext;
 }
@@ -468,7 +1001,14 @@ void drbd_al_begin_io_for_peer(struct drbd_peer_device *peer_device, struct drbd
 	for (enr = first; enr <= last; enr++) {
 		struct lc_element *al_ext;
 		wait_event(device->al_wait,
-				(al_ext = _al_get_for_peer(peer_device, enr)) != NULL);
+				(al_ext = _al_get_for_peer(peer_device, enr)) != NULL ||
+				al_commit_in_flight(device->act_log));
+		if (!al_ext) {
+			/* do not depend on the submitter to finish it */
+			drbd_al_commit_wait(device);
+			enr--;
+			continue;
+		}
 		if (al_ext->lc_number != enr)
 			need_transaction = true;
 	}
@@ -530,7 +1070,14 @@ int drbd_al_begin_io_nonblock(struct drbd_device *device, struct drbd_interval *
 		al_ext = lc_get_cumulative(device->act_log, enr);
 		if (!al_ext)
 			drbd_err(device, "LOGIC BUG for enr=%u\n", enr);
+		else
+			al_account_get(device, al_ext, enr);
 	}
+
+	/* A sequential writer needs a transaction to enter the next extent.
+	 * Activate the ones after it in the same transaction. */
+	if (al_seq_write(device, i, last) && al->pending_changes)
+		al_prefetch_locked(device, last);
 	return 0;
 }
 
@@ -554,8 +1101,10 @@ void drbd_al_complete_io(struct drbd_device *device, struct drbd_interval *i)
 			drbd_err(device, "al_complete_io() called on inactive extent %u\n", enr);
 			continue;
 		}
-		if (lc_put(device->act_log, extent) == 0)
+		if (lc_put(device->act_log, extent) == 0) {
+			al_account_put(device, extent);
 			wake = true;
+		}
 	}
 	spin_unlock_irqrestore(&device->al_lock, flags);
 	if (wake)
@@ -576,13 +1125,14 @@ static unsigned long al_extent_to_bm_bit(unsigned int al_enr)
 	return (unsigned long)al_enr << (AL_EXTENT_SHIFT - BM_BLOCK_SHIFT);
 }
 
-static sector_t al_tr_number_to_on_disk_sector(struct drbd_device *device)
+static sector_t al_tr_number_to_on_disk_sector(struct drbd_device *device,
+					       unsigned int tr_number)
 {
 	const unsigned int stripes = device->ldev->md.al_stripes;
 	const unsigned int stripe_size_4kB = device->ldev->md.al_stripe_size_4k;
 
 	/* transaction number, modulo on-disk ring buffer wrap around */
-	unsigned int t = device->al_tr_number % (device->ldev->md.al_size_4k);
+	unsigned int t = tr_number % (device->ldev->md.al_size_4k);
 
 	/* ... to aligned 4k on disk block */
 	t = ((t % stripes) * stripe_size_4kB) + t/stripes;
@@ -594,43 +1144,32 @@ static sector_t al_tr_number_to_on_disk_sector(struct drbd_device *device)
 	return device->ldev->md.md_offset + device->ldev->md.al_offset + t;
 }
 
-int al_write_transaction(struct drbd_device *device)
+/* The bitmap pages covering an extent that leaves the activity log
+ * have to reach the disk before the transaction evicting it. */
+static void al_mark_evicted(struct drbd_device *device, struct lc_element *e)
+{
+	unsigned long start, end;
+
+	if (e->lc_number == LC_FREE)
+		return;
+	start = al_extent_to_bm_bit(e->lc_number);
+	end = al_extent_to_bm_bit(e->lc_number + 1) - 1;
+	drbd_bm_mark_range_for_writeout(device, start, end);
+}
+
+/* The al_fill_*() functions record the changes on the to_be_changed list,
+ * starting with the skip'th one.  They return true if not all remaining
+ * changes fit into this transaction. */
+static bool al_fill_transaction(struct drbd_device *device,
+				struct al_transaction_on_disk *buffer,
+				unsigned int skip)
 {
-	struct al_transaction_on_disk *buffer;
 	struct lc_element *e;
-	sector_t sector;
+	bool more = false;
 	int i, mx;
 	unsigned extent_nr;
-	unsigned crc = 0;
-	int err = 0;
-
-	if (!get_ldev(device)) {
-		drbd_err(device, "disk is %s, cannot start al transaction\n",
-			drbd_disk_str(device->disk_state[NOW]));
-		return -EIO;
-	}
-
-	/* The bitmap write may have failed, causing a state change. */
-	if (device->disk_state[NOW] < D_INCONSISTENT) {
-		drbd_err(device,
-			"disk is %s, cannot write al transaction\n",
-			drbd_disk_str(device->disk_state[NOW]));
-		put_ldev(device);
-		return -EIO;
-	}
-
-	/* protects md_io_buffer, al_tr_cycle, ... */
-	buffer = drbd_md_get_buffer(device, __func__);
-	if (!buffer) {
-		drbd_err(device, "disk failed while waiting for md_io buffer\n");
-		put_ldev(device);
-		return -ENODEV;
-	}
-
-	memset(buffer, 0, sizeof(*buffer));
-	buffer->magic = cpu_to_be32(DRBD_AL_MAGIC);
-	buffer->tr_number = cpu_to_be32(device->al_tr_number);
 
+	buffer->transaction_type = cpu_to_be16(AL_TR_UPDATE);
 	i = 0;
 
 	/* Even though no one can start to change this list
@@ -639,23 +1178,20 @@ int al_write_transaction(struct drbd_device *device)
 	 * be in the process of changing it. */
 	spin_lock_irq(&device->al_lock);
 	list_for_each_entry(e, &device->act_log->to_be_changed, list) {
+		if (skip) {
+			skip--;
+			continue;
+		}
 		if (i == AL_UPDATES_PER_TRANSACTION) {
-			i++;
+			more = true;
 			break;
 		}
 		buffer->update_slot_nr[i] = cpu_to_be16(e->lc_index);
 		buffer->update_extent_nr[i] = cpu_to_be32(e->lc_new_number);
-		if (e->lc_number != LC_FREE) {
-			unsigned long start, end;
-
-			start = al_extent_to_bm_bit(e->lc_number);
-			end = al_extent_to_bm_bit(e->lc_number + 1) - 1;
-			drbd_bm_mark_range_for_writeout(device, start, end);
-		}
+		al_mark_evicted(device, e);
 		i++;
 	}
 	spin_unlock_irq(&device->al_lock);
-	BUG_ON(i > AL_UPDATES_PER_TRANSACTION);
 
 	buffer->n_updates = cpu_to_be16(i);
 	for ( ; i < AL_UPDATES_PER_TRANSACTION; i++) {
@@ -679,36 +1215,420 @@ int al_write_transaction(struct drbd_device *device)
 	device->al_tr_cycle += AL_CONTEXT_PER_TRANSACTION;
 	if (device->al_tr_cycle >= device->act_log->nr_elements)
 		device->al_tr_cycle = 0;
+	return more;
+}
 
-	sector = al_tr_number_to_on_disk_sector(device);
+static u8 *al_put_update(u8 *p, unsigned int slot, unsigned int enr, unsigned int *prev)
+{
+	s32 delta = enr - *prev;
+	u32 v = ((u32)delta << 1) ^ (u32)(delta >> 31);
+
+	*p++ = slot >> 8;
+	*p++ = slot;
+	while (v >= 0x80) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	*prev = enr;
+	return p;
+}
 
-	crc = crc32c(0, buffer, 4096);
-	buffer->crc32c = cpu_to_be32(crc);
+static bool al_fill_compact_transaction(struct drbd_device *device,
+					struct al_compact_transaction_on_disk *buffer,
+					unsigned int skip)
+{
+	struct lc_element *e;
+	unsigned int prev = 0;
+	u8 *p = buffer->payload;
+	__be32 *context;
+	bool more = false;
+	int i, mx;
 
-	if (drbd_bm_write_hinted(device))
-		err = -EIO;
-	else {
-		bool write_al_updates;
-		rcu_read_lock();
-		write_al_updates = rcu_dereference(device->ldev->disk_conf)->al_updates;
-		rcu_read_unlock();
-		if (write_al_updates) {
-			if (drbd_md_sync_page_io(device, device->ldev, sector, WRITE)) {
-				err = -EIO;
-				drbd_chk_io_error(device, 1, DRBD_META_IO_ERROR);
-			} else {
-				device->al_tr_number++;
-				device->al_writ_cnt++;
-			}
+	buffer->transaction_type = cpu_to_be16(AL_TR_COMPACT);
+	i = 0;
+
+	/* see al_fill_transaction() */
+	spin_lock_irq(&device->al_lock);
+	list_for_each_entry(e, &device->act_log->to_be_changed, list) {
+		if (skip) {
+			skip--;
+			continue;
+		}
+		if (i == AL_COMPACT_UPDATES_PER_TRANSACTION) {
+			more = true;
+			break;
 		}
+		p = al_put_update(p, e->lc_index, e->lc_new_number, &prev);
+		al_mark_evicted(device, e);
+		i++;
+	}
+	spin_unlock_irq(&device->al_lock);
+
+	buffer->n_updates = cpu_to_be16(i);
+	buffer->updates_bytes = cpu_to_be16(p - buffer->payload);
+
+	/* Everything after the updates is context.  The on-disk ring buffer is
+	 * sized for AL_COMPACT_CONTEXT_MIN, see drbd_al_extents_max(), so
+	 * small transactions make the context cycle through faster. */
+	context = (__be32 *)(buffer->payload + ALIGN(p - buffer->payload, 4));
+	mx = ((u8 *)buffer + 4096 - (u8 *)context) / sizeof(*context);
+	mx = min_t(int, mx, device->act_log->nr_elements - device->al_tr_cycle);
+
+	buffer->context_size = cpu_to_be16(device->act_log->nr_elements);
+	buffer->context_start_slot_nr = cpu_to_be16(device->al_tr_cycle);
+	buffer->n_context = cpu_to_be16(mx);
+	for (i = 0; i < mx; i++) {
+		unsigned idx = device->al_tr_cycle + i;
+		context[i] = cpu_to_be32(lc_element_by_index(device->act_log, idx)->lc_number);
+	}
+
+	device->al_tr_cycle += mx;
+	if (device->al_tr_cycle >= device->act_log->nr_elements)
+		device->al_tr_cycle = 0;
+	return more;
+}
+
+static bool al_fill_block(struct drbd_device *device, void *block,
+			  unsigned int tr_number, unsigned int skip)
+{
+	struct al_transaction_on_disk *buffer = block;
+	bool more;
+
+	memset(buffer, 0, sizeof(*buffer));
+	buffer->tr_number = cpu_to_be32(tr_number);
+
+	if (drbd_md_test_flag(device->ldev, MDF_AL_COMPACT)) {
+		buffer->magic = cpu_to_be32(DRBD_AL_COMPACT_MAGIC);
+		more = al_fill_compact_transaction(device, block, skip);
+	} else {
+		buffer->magic = cpu_to_be32(DRBD_AL_MAGIC);
+		more = al_fill_transaction(device, buffer, skip);
+	}
+
+	buffer->crc32c = cpu_to_be32(crc32c(0, buffer, 4096));
+	return more;
+}
+
+/* Fills the md_io buffer with the next transaction, and writes out the bitmap
+ * pages of evicted extents.  On success, the caller holds a local disk
+ * reference and the md_io buffer, and has to give both back through
+ * al_end_transaction(). */
+static int al_prepare_transaction(struct drbd_device *device, sector_t *sector)
+{
+	void *buffer;
+	bool more;
+
+	if (!get_ldev(device)) {
+		drbd_err(device, "disk is %s, cannot start al transaction\n",
+			drbd_disk_str(device->disk_state[NOW]));
+		return -EIO;
+	}
+
+	/* The bitmap write may have failed, causing a state change. */
+	if (device->disk_state[NOW] < D_INCONSISTENT) {
+		drbd_err(device,
+			"disk is %s, cannot write al transaction\n",
+			drbd_disk_str(device->disk_state[NOW]));
+		put_ldev(device);
+		return -EIO;
 	}
 
-	drbd_md_put_buffer(device);
+	/* protects md_io_buffer, al_tr_cycle, ... */
+	buffer = drbd_md_get_buffer(device, DRBD_MD_IO_AL, __func__);
+	if (!buffer) {
+		drbd_err(device, "disk failed while waiting for md_io buffer\n");
+		put_ldev(device);
+		return -ENODEV;
+	}
+
+	/* larger commits go through al_write_transactions() */
+	more = al_fill_block(device, buffer, device->al_tr_number, 0);
+	BUG_ON(more);
+	*sector = al_tr_number_to_on_disk_sector(device, device->al_tr_number);
+
+	if (drbd_bm_write_hinted(device)) {
+		drbd_md_put_buffer(device, DRBD_MD_IO_AL);
+		put_ldev(device);
+		return -EIO;
+	}
+	return 0;
+}
+
+static void al_end_transaction(struct drbd_device *device, bool written, int err)
+{
+	if (err) {
+		drbd_chk_io_error(device, 1, DRBD_META_IO_ERROR);
+	} else if (written) {
+		device->al_tr_number++;
+		device->al_writ_cnt++;
+	}
+	drbd_md_put_buffer(device, DRBD_MD_IO_AL);
 	put_ldev(device);
+}
+
+/* With al_dax, and meta data on a DAX capable device (pmem), store the
+ * prepared transaction with the CPU, and make it durable with wmb_pmem().
+ * Same place, same format as the block I/O would have written.
+ * Returns -EOPNOTSUPP if the caller needs to do block I/O instead. */
+static int al_write_dax(struct drbd_device *device, void *buffer, sector_t sector)
+{
+#ifdef COMPAT_HAVE_DAX_PMEM
+	void __pmem *addr;
+	unsigned long pfn;
+	long avail;
+
+	if (!al_dax || !arch_has_pmem_api())
+		return -EOPNOTSUPP;
+
+	/* The pmem driver maps the whole device statically,
+	 * this is cheap enough to do for every transaction. */
+	avail = bdev_direct_access(device->ldev->md_bdev, sector, &addr, &pfn, 4096);
+	if (avail < 4096)
+		return -EOPNOTSUPP;
+
+	memcpy_to_pmem(addr, buffer, 4096);
+	wmb_pmem();
+	return 0;
+#else
+	return -EOPNOTSUPP;
+#endif
+}
+
+int al_write_transaction(struct drbd_device *device)
+{
+	sector_t sector;
+	bool write_al_updates;
+	int err;
 
+	err = al_prepare_transaction(device, &sector);
+	if (err)
+		return err;
+
+	rcu_read_lock();
+	write_al_updates = rcu_dereference(device->ldev->disk_conf)->al_updates;
+	rcu_read_unlock();
+	if (write_al_updates) {
+		err = al_write_dax(device, page_address(device->md_io[DRBD_MD_IO_AL].page), sector);
+		if (err == -EOPNOTSUPP)
+			err = drbd_md_sync_page_io(device, device->ldev, DRBD_MD_IO_AL,
+						   sector, WRITE) ? -EIO : 0;
+	}
+
+	al_end_transaction(device, write_al_updates, err);
+	return err;
+}
+
+/* A commit with more changes than fit into one transaction, see
+ * drbd_al_max_pending_changes().
+ *
+ * Fills consecutive transactions into the AL md_io buffers, one each, and
+ * has all but the last one in flight at once; consecutive transaction
+ * numbers map to different AL stripes.  The last one is only submitted
+ * after the others completed, so the newest al_tr_number of a commit on
+ * disk implies all the others of it.  A crash before that may leave a gap
+ * among the first ones; they only carry extents nobody wrote to yet, as
+ * no writer uses any of the extents before the whole commit completed.
+ */
+static int al_write_transactions(struct drbd_device *device)
+{
+	struct bio *bios[AL_TR_PER_COMMIT_MAX];
+	unsigned int per_tr, n, i;
+	bool more = true;
+	int rw, err = 0;
+
+	if (!get_ldev(device)) {
+		drbd_err(device, "disk is %s, cannot start al transaction\n",
+			drbd_disk_str(device->disk_state[NOW]));
+		return -EIO;
+	}
+
+	/* The bitmap write may have failed, causing a state change. */
+	if (device->disk_state[NOW] < D_INCONSISTENT) {
+		drbd_err(device,
+			"disk is %s, cannot write al transaction\n",
+			drbd_disk_str(device->disk_state[NOW]));
+		put_ldev(device);
+		return -EIO;
+	}
+
+	per_tr = al_updates_per_transaction(device->ldev);
+	for (n = 0; more; n++) {
+		void *buffer;
+
+		BUG_ON(n >= drbd_al_tr_per_commit(device->ldev));
+		/* protects md_io_buffer, al_tr_cycle, ... */
+		buffer = drbd_md_get_buffer(device, DRBD_MD_IO_AL + n, __func__);
+		if (!buffer) {
+			drbd_err(device, "disk failed while waiting for md_io buffer\n");
+			err = -ENODEV;
+			goto out;
+		}
+		more = al_fill_block(device, buffer, device->al_tr_number + n, n * per_tr);
+	}
+
+	if (drbd_bm_write_hinted(device)) {
+		err = -EIO;
+		goto out;
+	}
+
+	rw = md_io_rw(device, WRITE);
+	for (i = 0; i < n - 1; i++) {
+		struct drbd_md_io *md_io = &device->md_io[DRBD_MD_IO_AL + i];
+		sector_t sector = al_tr_number_to_on_disk_sector(device, device->al_tr_number + i);
+		int e;
+
+		bios[i] = NULL;
+		e = al_write_dax(device, page_address(md_io->page), sector);
+		if (e == -EOPNOTSUPP)
+			e = _drbd_md_submit_page_io(device, device->ldev, md_io,
+						    sector, rw, &bios[i]);
+		if (e)
+			err = -EIO;
+	}
+	drbd_blk_run_queue(bdev_get_queue(device->ldev->md_bdev));
+	for (i = 0; i < n - 1; i++) {
+		if (!bios[i])
+			continue;
+		if (_drbd_md_wait_page_io(device, device->ldev,
+					  &device->md_io[DRBD_MD_IO_AL + i], bios[i]))
+			err = -EIO;
+		bio_put(bios[i]);
+	}
+
+	if (!err) {
+		sector_t sector = al_tr_number_to_on_disk_sector(device, device->al_tr_number + i);
+
+		err = al_write_dax(device, page_address(device->md_io[DRBD_MD_IO_AL + i].page), sector);
+		if (err == -EOPNOTSUPP)
+			err = drbd_md_sync_page_io(device, device->ldev, DRBD_MD_IO_AL + i,
+						   sector, WRITE) ? -EIO : 0;
+	}
+
+	if (err) {
+		drbd_err(device, "writing %u al transactions failed\n", n);
+		drbd_chk_io_error(device, 1, DRBD_META_IO_ERROR);
+	} else {
+		device->al_tr_number += n;
+		device->al_writ_cnt += n;
+	}
+out:
+	while (n--)
+		drbd_md_put_buffer(device, DRBD_MD_IO_AL + n);
+	put_ldev(device);
 	return err;
 }
 
+#ifdef REQ_FLUSH
+/* Cross volume group commit of activity log transactions.
+ *
+ * Volumes of a resource often keep their meta data on the same device.
+ * Their transactions are queued on the resource; whoever finds no batch
+ * in flight becomes the committer, and submits all queued transactions
+ * at once, before waiting for any of them.  Transactions prepared while
+ * a batch is in flight go into the next one.  Being in flight together,
+ * the block layer can merge the cache flushes of the FUA writes to a
+ * shared meta data device.  Each transaction still goes to its own
+ * volume's on disk ring buffer, nothing changes on disk.
+ */
+static bool al_group_done_or_commit(struct drbd_al_group *group,
+				    struct drbd_device *device, bool *commit)
+{
+	bool rv;
+
+	spin_lock(&group->lock);
+	rv = device->al_group_done;
+	if (!rv && !group->committing) {
+		group->committing = true;
+		*commit = true;
+		rv = true;
+	}
+	spin_unlock(&group->lock);
+	return rv;
+}
+
+static void al_group_commit_batch(struct drbd_al_group *group)
+{
+	struct drbd_device *device, *tmp;
+	LIST_HEAD(batch);
+
+	spin_lock(&group->lock);
+	list_splice_init(&group->queued, &batch);
+	spin_unlock(&group->lock);
+
+	list_for_each_entry(device, &batch, al_group_list)
+		device->al_group_err = _drbd_md_submit_page_io(device, device->ldev,
+				&device->md_io[DRBD_MD_IO_AL],
+				device->al_group_sector, md_io_rw(device, WRITE),
+				&device->al_group_bio);
+
+	list_for_each_entry(device, &batch, al_group_list) {
+		if (device->al_group_err)
+			continue;
+		device->al_group_err = _drbd_md_wait_page_io(device, device->ldev,
+							      &device->md_io[DRBD_MD_IO_AL],
+							      device->al_group_bio);
+		bio_put(device->al_group_bio);
+	}
+
+	spin_lock(&group->lock);
+	group->batches++;
+	list_for_each_entry_safe(device, tmp, &batch, al_group_list) {
+		list_del_init(&device->al_group_list);
+		device->al_group_done = true;
+		group->transactions++;
+	}
+	group->committing = false;
+	spin_unlock(&group->lock);
+	wake_up_all(&group->wait);
+}
+
+static int al_group_write_transaction(struct drbd_device *device)
+{
+	struct drbd_al_group *group = &device->resource->al_group;
+	sector_t sector;
+	int err;
+
+	err = al_prepare_transaction(device, &sector);
+	if (err)
+		return err;
+
+	/* nothing to batch without block I/O */
+	err = al_write_dax(device, page_address(device->md_io[DRBD_MD_IO_AL].page), sector);
+	if (err != -EOPNOTSUPP) {
+		al_end_transaction(device, true, err);
+		return err;
+	}
+
+	spin_lock(&group->lock);
+	device->al_group_sector = sector;
+	device->al_group_done = false;
+	list_add_tail(&device->al_group_list, &group->queued);
+	spin_unlock(&group->lock);
+
+	for (;;) {
+		bool commit = false;
+
+		wait_event(group->wait, al_group_done_or_commit(group, device, &commit));
+		if (!commit)
+			break;
+		al_group_commit_batch(group);
+	}
+
+	err = device->al_group_err ? -EIO : 0;
+	if (err)
+		drbd_err(device, "al group commit to sector %llus failed with error %d\n",
+			 (unsigned long long)sector, device->al_group_err);
+	al_end_transaction(device, true, err);
+	return err;
+}
+#else
+static int al_group_write_transaction(struct drbd_device *device)
+{
+	return al_write_transaction(device);
+}
+#endif
+
 static int _try_lc_del(struct drbd_device *device, struct lc_element *al_ext)
 {
 	int rv;
@@ -806,13 +1726,17 @@ consider_sending_peers_in_sync(struct drbd_peer_device *peer_device, unsigned in
 	}
 }
 
-int drbd_initialize_al(struct drbd_device *device, void *buffer)
+int drbd_initialize_al(struct drbd_device *device)
 {
-	struct al_transaction_on_disk *al = buffer;
+	struct al_transaction_on_disk *al;
 	struct drbd_md *md = &device->ldev->md;
 	sector_t al_base = md->md_offset + md->al_offset;
 	int al_size_4k = md->al_stripes * md->al_stripe_size_4k;
-	int i;
+	int i, err = 0;
+
+	al = drbd_md_get_buffer(device, DRBD_MD_IO_AL, __func__);
+	if (!al)
+		return -ENODEV;
 
 	memset(al, 0, 4096);
 	al->magic = cpu_to_be32(DRBD_AL_MAGIC);
@@ -820,11 +1744,13 @@ int drbd_initialize_al(struct drbd_device *device, void *buffer)
 	al->crc32c = cpu_to_be32(crc32c(0, al, 4096));
 
 	for (i = 0; i < al_size_4k; i++) {
-		int err = drbd_md_sync_page_io(device, device->ldev, al_base + i * 8, WRITE);
+		err = drbd_md_sync_page_io(device, device->ldev, DRBD_MD_IO_AL,
+					   al_base + i * 8, WRITE);
 		if (err)
-			return err;
+			break;
 	}
-	return 0;
+	drbd_md_put_buffer(device, DRBD_MD_IO_AL);
+	return err;
 }
 
 static int w_update_peers(struct drbd_work *w, int unused)
@@ -1039,6 +1965,21 @@ static void maybe_schedule_on_disk_bitmap_update(struct drbd_peer_device *peer_d
 }
 
 
+static void update_sync_bits_done(struct drbd_peer_device *peer_device,
+		unsigned long count, bool cleared,
+		enum update_sync_bits_mode mode)
+{
+	if (mode == SET_IN_SYNC) {
+		unsigned long still_to_go = drbd_bm_total_weight(peer_device);
+		bool rs_is_done = (still_to_go <= peer_device->rs_failed);
+		drbd_advance_rs_marks(peer_device, still_to_go);
+		if (cleared || rs_is_done)
+			maybe_schedule_on_disk_bitmap_update(peer_device, rs_is_done);
+	} else if (mode == RECORD_RS_FAILED)
+		peer_device->rs_failed += count;
+	wake_up(&peer_device->device->al_wait);
+}
+
 static int update_sync_bits(struct drbd_peer_device *peer_device,
 		unsigned long sbnr, unsigned long ebnr,
 		enum update_sync_bits_mode mode)
@@ -1080,20 +2021,57 @@ static int update_sync_bits(struct drbd_peer_device *peer_device,
 		}
 		sbnr = tbnr + 1;
 	}
-	if (count) {
-		if (mode == SET_IN_SYNC) {
-			unsigned long still_to_go = drbd_bm_total_weight(peer_device);
-			bool rs_is_done = (still_to_go <= peer_device->rs_failed);
-			drbd_advance_rs_marks(peer_device, still_to_go);
-			if (cleared || rs_is_done)
-				maybe_schedule_on_disk_bitmap_update(peer_device, rs_is_done);
-		} else if (mode == RECORD_RS_FAILED)
-			peer_device->rs_failed += count;
-		wake_up(&device->al_wait);
-	}
+	if (count)
+		update_sync_bits_done(peer_device, count, cleared, mode);
 	return count;
 }
 
+/*
+ * Like update_sync_bits(), for all bitmap indexes in mask at once.  Bitmap
+ * indexes are interleaved word by word, so changing them together touches
+ * each bitmap page once per resync extent instead of once per peer.
+ * Bitmap indexes without a peer device only get their bits changed.
+ * Called with rcu_read_lock() held.
+ */
+static void update_sync_bits_mask(struct drbd_device *device, unsigned long mask,
+		unsigned long sbnr, unsigned long ebnr,
+		enum update_sync_bits_mode mode)
+{
+	unsigned int c[DRBD_PEERS_MAX], count[DRBD_PEERS_MAX] = { };
+	unsigned long cleared = 0;
+	struct drbd_peer_device *peer_device;
+	unsigned long flags;
+
+	while (sbnr <= ebnr) {
+		unsigned long tbnr = min(ebnr, sbnr | BM_BLOCKS_PER_BM_EXT_MASK);
+
+		if (mode == SET_IN_SYNC)
+			drbd_bm_clear_bits_mask(device, mask, sbnr, tbnr, c);
+		else /* if (mode == SET_OUT_OF_SYNC) */
+			drbd_bm_set_bits_mask(device, mask, sbnr, tbnr, c);
+
+		spin_lock_irqsave(&device->al_lock, flags);
+		for_each_peer_device_rcu(peer_device, device) {
+			int bmi = peer_device->bitmap_index;
+
+			if (!test_bit(bmi, &mask) || !c[bmi])
+				continue;
+			if (update_rs_extent(peer_device, BM_BIT_TO_EXT(sbnr), c[bmi], mode))
+				__set_bit(bmi, &cleared);
+			count[bmi] += c[bmi];
+		}
+		spin_unlock_irqrestore(&device->al_lock, flags);
+		sbnr = tbnr + 1;
+	}
+
+	for_each_peer_device_rcu(peer_device, device) {
+		int bmi = peer_device->bitmap_index;
+
+		if (test_bit(bmi, &mask) && count[bmi])
+			update_sync_bits_done(peer_device, count[bmi], test_bit(bmi, &cleared), mode);
+	}
+}
+
 /* clear the bit corresponding to the piece of storage in question:
  * size byte of data starting from sector.  Only clear a bits of the affected
  * one ore more _aligned_ BM_BLOCK_SIZE blocks.
@@ -1176,7 +2154,6 @@ bool drbd_set_sync(struct drbd_device *device, sector_t sector, int size,
 	long set_start, set_end, clear_start, clear_end;
 	sector_t esector, nr_sectors;
 	bool set = false;
-	struct drbd_peer_device *peer_device;
 
 	mask &= (1 << device->bitmap->bm_max_peers) - 1;
 
@@ -1212,31 +2189,11 @@ bool drbd_set_sync(struct drbd_device *device, sector_t sector, int size,
 		clear_end = BM_SECT_TO_BIT(esector + 1) - 1;
 
 	rcu_read_lock();
-	for_each_peer_device_rcu(peer_device, device) {
-		int bitmap_index = peer_device->bitmap_index;
-
-		if (!test_and_clear_bit(bitmap_index, &mask))
-			continue;
-
-		if (test_bit(bitmap_index, &bits))
-			update_sync_bits(peer_device, set_start, set_end, SET_OUT_OF_SYNC);
-
-		else if (clear_start <= clear_end)
-			update_sync_bits(peer_device, clear_start, clear_end, SET_IN_SYNC);
-	}
+	if (mask & bits)
+		update_sync_bits_mask(device, mask & bits, set_start, set_end, SET_OUT_OF_SYNC);
+	if ((mask & ~bits) && clear_start <= clear_end)
+		update_sync_bits_mask(device, mask & ~bits, clear_start, clear_end, SET_IN_SYNC);
 	rcu_read_unlock();
-	if (mask) {
-		int bitmap_index;
-
-		for_each_set_bit(bitmap_index, &mask, BITS_PER_LONG) {
-			if (test_bit(bitmap_index, &bits))
-				drbd_bm_set_bits(device, bitmap_index,
-						 set_start, set_end);
-			else if (clear_start <= clear_end)
-				drbd_bm_clear_bits(device, bitmap_index,
-						   clear_start, clear_end);
-		}
-	}
 
 out:
 	put_ldev(device);
@@ -391,6 +391,20 @@ static struct page **bm_realloc_pages(struct drbd_bitmap *b, unsigned long want)
 	return new_pages;
 }
 
+static unsigned long *bm_alloc_summary(unsigned long longs, int *vmalloced)
+{
+	unsigned long *summary;
+	size_t bytes = longs * sizeof(long);
+
+	*vmalloced = 0;
+	summary = kzalloc(bytes, GFP_NOIO | __GFP_NOWARN);
+	if (!summary) {
+		summary = __vmalloc(bytes, GFP_NOIO | __GFP_HIGHMEM | __GFP_ZERO, PAGE_KERNEL);
+		*vmalloced = 1;
+	}
+	return summary;
+}
+
 struct drbd_bitmap *drbd_bm_alloc(void)
 {
 	struct drbd_bitmap *b;
@@ -419,6 +433,7 @@ void drbd_bm_free(struct drbd_bitmap *bitmap)
 {
 	bm_free_pages(bitmap->bm_pages, bitmap->bm_number_of_pages);
 	bm_vk_free(bitmap->bm_pages, (BM_P_VMALLOCED & bitmap->bm_flags));
+	bm_vk_free(bitmap->bm_summary, (BM_S_VMALLOCED & bitmap->bm_flags));
 	kfree(bitmap);
 }
 
@@ -466,6 +481,65 @@ static inline unsigned long bit_to_page_interleaved(struct drbd_bitmap *bitmap,
 	return word32_to_page(interleaved_word32(bitmap, bitmap_index, bit));
 }
 
+/*
+ * The summary bitmap has one bit per BM_SUMMARY_BITS bits (64 words) of each
+ * peer's bitmap.  A summary bit is set if and only if that part of the bitmap
+ * has at least one bit set, so find_next can skip clean areas without mapping
+ * their pages.  Like the bitmap itself, it is protected by bm_lock.
+ */
+#define BM_SUMMARY_SHIFT	11
+#define BM_SUMMARY_BITS		(1UL << BM_SUMMARY_SHIFT)
+
+static inline unsigned long *bm_summary(struct drbd_bitmap *bitmap, unsigned int bitmap_index)
+{
+	return bitmap->bm_summary + bitmap_index * bitmap->bm_summary_longs;
+}
+
+static inline unsigned long bm_summary_chunks(unsigned long bits)
+{
+	return DIV_ROUND_UP(bits, BM_SUMMARY_BITS);
+}
+
+static void bm_summary_mark(struct drbd_bitmap *bitmap, unsigned int bitmap_index,
+			    unsigned long start, unsigned long end)
+{
+	unsigned long *summary = bm_summary(bitmap, bitmap_index);
+	unsigned long chunk;
+
+	for (chunk = start >> BM_SUMMARY_SHIFT; chunk <= end >> BM_SUMMARY_SHIFT; chunk++)
+		__set_bit(chunk, summary);
+}
+
+/* Returns the first bit at or after start in a part of the bitmap that has bits
+ * set according to the summary, or bm_bits if there is none. */
+static inline unsigned long bm_summary_next(struct drbd_bitmap *bitmap, unsigned int bitmap_index,
+					    unsigned long start)
+{
+	unsigned long chunks = bm_summary_chunks(bitmap->bm_bits);
+	unsigned long chunk;
+
+	chunk = find_next_bit(bm_summary(bitmap, bitmap_index), chunks, start >> BM_SUMMARY_SHIFT);
+	if (chunk >= chunks)
+		return bitmap->bm_bits;
+	return max(start, chunk << BM_SUMMARY_SHIFT);
+}
+
+/* Number of bits set from first to last, which are within the same word. */
+static inline unsigned int bm_count_word32(__le32 *addr, unsigned int first, unsigned int last)
+{
+	u32 word = le32_to_cpu(addr[first >> 5]) >> (first & 31);
+
+	return hweight32(word & (~0U >> (31 - (last - first))));
+}
+
+#ifdef COMPAT_KMAP_ATOMIC_PAGE_ONLY
+#define bm_summary_clear(device, bitmap_index, start, end, km_type) \
+	bm_summary_clear(device, bitmap_index, start, end)
+#endif
+static noinline void
+bm_summary_clear(struct drbd_device *device, unsigned int bitmap_index,
+		 unsigned long start, unsigned long end, enum km_type km_type);
+
 #ifdef COMPAT_KMAP_ATOMIC_PAGE_ONLY
 #define ____bm_op(device, bitmap_index, start, end, op, buffer, km_type) \
 	____bm_op(device, bitmap_index, start, end, op, buffer)
@@ -477,6 +551,7 @@ ____bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long s
 	struct drbd_bitmap *bitmap = device->bitmap;
 	unsigned int word32_skip = 32 * bitmap->bm_max_peers;
 	unsigned long total = 0;
+	unsigned long first = start;
 	unsigned long word;
 	unsigned int page, bit_in_page;
 
@@ -507,10 +582,6 @@ ____bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long s
 						if (!__test_and_set_bit_le(bit_in_page, addr))
 							count++;
 						break;
-					case BM_OP_COUNT:
-						if (test_bit_le(bit_in_page, addr))
-							total++;
-						break;
 					case BM_OP_TEST:
 						total = !!test_bit_le(bit_in_page, addr);
 						drbd_kunmap_atomic(addr, km_type);
@@ -521,6 +592,10 @@ ____bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long s
 					bit_in_page++;
 				} while (bit_in_page <= last);
 				break;
+			case BM_OP_COUNT:
+				total += bm_count_word32(addr, bit_in_page, last);
+				bit_in_page = last + 1;
+				break;
 			case BM_OP_MERGE:
 			case BM_OP_EXTRACT:
 				BUG();
@@ -563,8 +638,12 @@ ____bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long s
 				total += hweight32(*p);
 				break;
 			case BM_OP_MERGE:
-				count += hweight32(~*p & *buffer);
-				*p |= *buffer++;
+				if (*buffer) {
+					__set_bit(start >> BM_SUMMARY_SHIFT, bm_summary(bitmap, bitmap_index));
+					count += hweight32(~*p & *buffer);
+					*p |= *buffer;
+				}
+				buffer++;
 				break;
 			case BM_OP_EXTRACT:
 				*buffer++ = *p;
@@ -598,10 +677,6 @@ ____bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long s
 					if (!__test_and_set_bit_le(bit_in_page, addr))
 						count++;
 					break;
-				case BM_OP_COUNT:
-					if (test_bit_le(bit_in_page, addr))
-						total++;
-					break;
 				default:
 					break;
 				}
@@ -609,11 +684,17 @@ ____bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long s
 				bit_in_page++;
 			}
 			break;
+		case BM_OP_COUNT:
+			total += bm_count_word32(addr, bit_in_page, bit_in_page + (end - start));
+			start = end + 1;
+			break;
 		case BM_OP_MERGE:
 			{
 				__le32 *p = (__le32 *)addr + (bit_in_page >> 5);
 				__le32 b = *buffer++ & cpu_to_le32((1 << (end - start + 1)) - 1);
 
+				if (b)
+					__set_bit(start >> BM_SUMMARY_SHIFT, bm_summary(bitmap, bitmap_index));
 				count += hweight32(~*p & b);
 				*p |= b;
 
@@ -677,10 +758,17 @@ ____bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long s
 	}
 	switch(op) {
 	case BM_OP_CLEAR:
-		if (total)
+		if (total) {
 			bitmap->bm_set[bitmap_index] -= total;
+			bm_summary_clear(device, bitmap_index, first, end, km_type);
+		}
 		break;
 	case BM_OP_SET:
+		if (total) {
+			bitmap->bm_set[bitmap_index] += total;
+			bm_summary_mark(bitmap, bitmap_index, first, end);
+		}
+		break;
 	case BM_OP_MERGE:
 		if (total)
 			bitmap->bm_set[bitmap_index] += total;
@@ -695,6 +783,79 @@ ____bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long s
 	return total;
 }
 
+/* Clear the summary bits of all chunks within [start, end] that have no bits
+ * set any more.  Chunks fully covered by the range just got cleared; those
+ * only partially covered need to be looked at. */
+static noinline void
+bm_summary_clear(struct drbd_device *device, unsigned int bitmap_index,
+		 unsigned long start, unsigned long end, enum km_type km_type)
+{
+	struct drbd_bitmap *bitmap = device->bitmap;
+	unsigned long *summary = bm_summary(bitmap, bitmap_index);
+	unsigned long chunk;
+
+	for (chunk = start >> BM_SUMMARY_SHIFT; chunk <= end >> BM_SUMMARY_SHIFT; chunk++) {
+		unsigned long chunk_start = chunk << BM_SUMMARY_SHIFT;
+		unsigned long chunk_end = min(chunk_start + BM_SUMMARY_BITS, bitmap->bm_bits) - 1;
+
+		if (!test_bit(chunk, summary))
+			continue;
+		if ((chunk_start < start || chunk_end > end) &&
+		    ____bm_op(device, bitmap_index, chunk_start, chunk_end,
+			      BM_OP_FIND_BIT, NULL, km_type) != DRBD_END_OF_BITMAP)
+			continue;
+		__clear_bit(chunk, summary);
+	}
+}
+
+/* Like BM_OP_FIND_BIT, but only looks into those parts of the bitmap
+ * the summary claims to have bits set. */
+#ifdef COMPAT_KMAP_ATOMIC_PAGE_ONLY
+#define bm_find_next(device, bitmap_index, start, end, km_type) \
+	bm_find_next(device, bitmap_index, start, end)
+#endif
+static __always_inline unsigned long
+bm_find_next(struct drbd_device *device, unsigned int bitmap_index, unsigned long start,
+	     unsigned long end, enum km_type km_type)
+{
+	struct drbd_bitmap *bitmap = device->bitmap;
+
+	if (end >= bitmap->bm_bits)
+		end = bitmap->bm_bits - 1;
+
+	while ((start = bm_summary_next(bitmap, bitmap_index, start)) <= end) {
+		unsigned long chunk_end = min(start | (BM_SUMMARY_BITS - 1), end);
+		unsigned long bit;
+
+		bit = ____bm_op(device, bitmap_index, start, chunk_end, BM_OP_FIND_BIT, NULL, km_type);
+		if (bit != DRBD_END_OF_BITMAP)
+			return bit;
+		start = chunk_end + 1;
+	}
+	return DRBD_END_OF_BITMAP;
+}
+
+/* Like BM_OP_COUNT, but skips the parts of the bitmap
+ * the summary knows to have no bits set. */
+static __always_inline unsigned long
+bm_count(struct drbd_device *device, unsigned int bitmap_index, unsigned long start,
+	 unsigned long end)
+{
+	struct drbd_bitmap *bitmap = device->bitmap;
+	unsigned long total = 0;
+
+	if (end >= bitmap->bm_bits)
+		end = bitmap->bm_bits - 1;
+
+	while ((start = bm_summary_next(bitmap, bitmap_index, start)) <= end) {
+		unsigned long chunk_end = min(start | (BM_SUMMARY_BITS - 1), end);
+
+		total += ____bm_op(device, bitmap_index, start, chunk_end, BM_OP_COUNT, NULL, KM_IRQ1);
+		start = chunk_end + 1;
+	}
+	return total;
+}
+
 /* Returns the number of bits changed.  */
 static __always_inline unsigned long
 __bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long start, unsigned long end,
@@ -731,6 +892,10 @@ __bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long sta
 			break;
 		}
 	}
+	if (op == BM_OP_FIND_BIT)
+		return bm_find_next(device, bitmap_index, start, end, KM_IRQ1);
+	if (op == BM_OP_COUNT)
+		return bm_count(device, bitmap_index, start, end);
 	return ____bm_op(device, bitmap_index, start, end, op, buffer, KM_IRQ1);
 }
 
@@ -784,19 +949,44 @@ bm_op(struct drbd_device *device, unsigned int bitmap_index, unsigned long start
 static void bm_count_bits(struct drbd_device *device)
 {
 	struct drbd_bitmap *bitmap = device->bitmap;
-	unsigned int bitmap_index;
-
-	for (bitmap_index = 0; bitmap_index < bitmap->bm_max_peers; bitmap_index++) {
-		unsigned long bit = 0, bits_set = 0;
-
-		while (bit < bitmap->bm_bits) {
-			unsigned long last_bit = last_bit_on_page(bitmap, bitmap_index, bit);
-
-			bits_set += ___bm_op(device, bitmap_index, bit, last_bit, BM_OP_COUNT, NULL, KM_USER0);
-			bit = last_bit + 1;
-			cond_resched();
+	unsigned int max_peers = bitmap->bm_max_peers;
+	unsigned long words_per_peer = DIV_ROUND_UP(bitmap->bm_bits, 32);
+	unsigned long words = words_per_peer * max_peers;
+	u32 last_mask = ~0U >> ((32 - (bitmap->bm_bits & 31)) & 31);
+	unsigned long word = 0;
+	unsigned int bitmap_index, page;
+
+	for (bitmap_index = 0; bitmap_index < max_peers; bitmap_index++)
+		bitmap->bm_set[bitmap_index] = 0;
+	memset(bitmap->bm_summary, 0, max_peers * bitmap->bm_summary_longs * sizeof(long));
+
+	/* Walk each page once, and count the bits of all peers in it,
+	 * instead of mapping every page once per peer. */
+	for (page = 0; word < words; page++) {
+		unsigned int i, n = min_t(unsigned long, words - word, BITS_PER_PAGE / 32);
+		unsigned long word_in_peer = word / max_peers;
+		__le32 *addr;
+
+		bitmap_index = word % max_peers;
+		addr = drbd_kmap_atomic(bitmap->bm_pages[page], KM_USER0);
+		for (i = 0; i < n; i++) {
+			u32 w = le32_to_cpu(addr[i]);
+
+			if (w && word_in_peer == words_per_peer - 1)
+				w &= last_mask;
+			if (w) {
+				bitmap->bm_set[bitmap_index] += hweight32(w);
+				__set_bit(word_in_peer >> (BM_SUMMARY_SHIFT - 5),
+					  bm_summary(bitmap, bitmap_index));
+			}
+			if (++bitmap_index == max_peers) {
+				bitmap_index = 0;
+				word_in_peer++;
+			}
 		}
-		bitmap->bm_set[bitmap_index] = bits_set;
+		drbd_kunmap_atomic(addr, KM_USER0);
+		word += n;
+		cond_resched();
 	}
 }
 
@@ -831,8 +1021,10 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, int set_new_bi
 	unsigned long bits, words, obits;
 	unsigned long want, have, onpages; /* number of pages */
 	struct page **npages, **opages = NULL;
+	unsigned long *nsummary, *osummary;
+	unsigned long summary_longs, osummary_longs;
 	int err = 0, growing;
-	int opages_vmalloced;
+	int opages_vmalloced, osummary_vmalloced, nsummary_vmalloced;
 
 	if (!expect(device, b))
 		return -ENOMEM;
@@ -846,6 +1038,7 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, int set_new_bi
 		goto out;
 
 	opages_vmalloced = (BM_P_VMALLOCED & b->bm_flags);
+	osummary_vmalloced = (BM_S_VMALLOCED & b->bm_flags);
 
 	if (capacity == 0) {
 		unsigned int bitmap_index;
@@ -853,8 +1046,11 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, int set_new_bi
 		spin_lock_irq(&b->bm_lock);
 		opages = b->bm_pages;
 		onpages = b->bm_number_of_pages;
+		osummary = b->bm_summary;
 		b->bm_pages = NULL;
 		b->bm_number_of_pages = 0;
+		b->bm_summary = NULL;
+		b->bm_summary_longs = 0;
 		for (bitmap_index = 0; bitmap_index < b->bm_max_peers; bitmap_index++)
 			b->bm_set[bitmap_index] = 0;
 		b->bm_bits = 0;
@@ -863,6 +1059,7 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, int set_new_bi
 		spin_unlock_irq(&b->bm_lock);
 		bm_free_pages(opages, onpages);
 		bm_vk_free(opages, opages_vmalloced);
+		bm_vk_free(osummary, osummary_vmalloced);
 		goto out;
 	}
 	bits  = BM_SECT_TO_BIT(ALIGN(capacity, BM_SECT_PER_BIT));
@@ -879,6 +1076,13 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, int set_new_bi
 		}
 	}
 
+	summary_longs = BITS_TO_LONGS(bm_summary_chunks(bits));
+	nsummary = bm_alloc_summary(summary_longs * b->bm_max_peers, &nsummary_vmalloced);
+	if (!nsummary) {
+		err = -ENOMEM;
+		goto out;
+	}
+
 	want = ALIGN(words*sizeof(long), PAGE_SIZE) >> PAGE_SHIFT;
 	have = b->bm_number_of_pages;
 	if (want == have) {
@@ -892,6 +1096,7 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, int set_new_bi
 	}
 
 	if (!npages) {
+		bm_vk_free(nsummary, nsummary_vmalloced);
 		err = -ENOMEM;
 		goto out;
 	}
@@ -899,6 +1104,8 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, int set_new_bi
 	spin_lock_irq(&b->bm_lock);
 	opages = b->bm_pages;
 	obits  = b->bm_bits;
+	osummary = b->bm_summary;
+	osummary_longs = b->bm_summary_longs;
 
 	growing = bits > obits;
 
@@ -907,12 +1114,34 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, int set_new_bi
 	b->bm_bits  = bits;
 	b->bm_words = words;
 	b->bm_dev_capacity = capacity;
+	b->bm_summary = nsummary;
+	b->bm_summary_longs = summary_longs;
+	if (nsummary_vmalloced)
+		b->bm_flags |= BM_S_VMALLOCED;
+	else
+		b->bm_flags &= ~BM_S_VMALLOCED;
 
-	if (growing && set_new_bits) {
+	if (osummary) {
 		unsigned int bitmap_index;
 
 		for (bitmap_index = 0; bitmap_index < b->bm_max_peers; bitmap_index++)
-			___bm_op(device, bitmap_index, obits, -1UL, BM_OP_SET, NULL, KM_IRQ1);
+			memcpy(bm_summary(b, bitmap_index), osummary + bitmap_index * osummary_longs,
+			       min(summary_longs, osummary_longs) * sizeof(long));
+	}
+
+	if (growing) {
+		/* New pages are zeroed, but those we keep may have stale bits
+		 * beyond obits from an earlier shrink. */
+		unsigned long stale_bits = min(bits,
+			(have << (PAGE_SHIFT - 2)) / b->bm_max_peers * 32);
+		unsigned int bitmap_index;
+
+		for (bitmap_index = 0; bitmap_index < b->bm_max_peers; bitmap_index++) {
+			if (set_new_bits)
+				___bm_op(device, bitmap_index, obits, -1UL, BM_OP_SET, NULL, KM_IRQ1);
+			else if (obits < stale_bits)
+				bm_summary_mark(b, bitmap_index, obits, stale_bits - 1);
+		}
 	}
 
 	if (want < have) {
@@ -923,6 +1152,7 @@ int drbd_bm_resize(struct drbd_device *device, sector_t capacity, int set_new_bi
 	spin_unlock_irq(&b->bm_lock);
 	if (opages != npages)
 		bm_vk_free(opages, opages_vmalloced);
+	bm_vk_free(osummary, osummary_vmalloced);
 	if (!growing)
 		bm_count_bits(device);
 	drbd_info(device, "resync bitmap: bits=%lu words=%lu pages=%lu\n", bits, words, want);
@@ -1397,8 +1627,8 @@ unsigned long drbd_bm_find_next_zero(struct drbd_peer_device *peer_device, unsig
 unsigned long _drbd_bm_find_next(struct drbd_peer_device *peer_device, unsigned long start)
 {
 	/* WARN_ON(!(device->b->bm_flags & BM_LOCK_SET)); */
-	return ____bm_op(peer_device->device, peer_device->bitmap_index, start, -1UL,
-		    BM_OP_FIND_BIT, NULL, KM_USER0);
+	return bm_find_next(peer_device->device, peer_device->bitmap_index, start, -1UL,
+			    KM_USER0);
 }
 
 unsigned long _drbd_bm_find_next_zero(struct drbd_peer_device *peer_device, unsigned long start)
@@ -1485,6 +1715,110 @@ unsigned int drbd_bm_clear_bits(struct drbd_device *device, unsigned int bitmap_
 	return bm_op(device, bitmap_index, start, end, BM_OP_CLEAR, NULL);
 }
 
+static void bm_set_page_changed(struct page *page, enum bitmap_operations op)
+{
+	if (op == BM_OP_SET)
+		bm_set_page_need_writeout(page);
+	else
+		bm_set_page_lazy_writeout(page);
+}
+
+/*
+ * Set or clear bits start..end in all bitmap slots in mask.  The words of the
+ * different slots are interleaved, so doing this in one pass maps each page
+ * once instead of once per slot.  The number of bits changed in each slot
+ * is returned in changed[bitmap_index].
+ */
+static void bm_op_mask(struct drbd_device *device, unsigned long mask,
+		       unsigned long start, unsigned long end,
+		       enum bitmap_operations op, unsigned int *changed)
+{
+	struct drbd_bitmap *bitmap = device->bitmap;
+	unsigned int bitmap_index, page = -1U;
+	bool page_changed = false;
+	unsigned long irq_flags, bit;
+	__le32 *addr = NULL;
+
+	for_each_set_bit(bitmap_index, &mask, DRBD_PEERS_MAX)
+		changed[bitmap_index] = 0;
+
+	spin_lock_irqsave(&bitmap->bm_lock, irq_flags);
+	if (!expect(device, bitmap->bm_pages) || !bitmap->bm_bits)
+		goto out;
+	if (bitmap->bm_task != current &&
+	    bitmap->bm_flags & (op == BM_OP_SET ? BM_LOCK_SET : BM_LOCK_CLEAR))
+		bm_print_lock_info(device);
+
+	if (end >= bitmap->bm_bits)
+		end = bitmap->bm_bits - 1;
+
+	for (bit = start; bit <= end; bit = (bit | 31) + 1) {
+		unsigned long last = min(bit | 31, end);
+		__le32 bits = cpu_to_le32((~0U >> (31 - (last - bit))) << (bit & 31));
+
+		for_each_set_bit(bitmap_index, &mask, bitmap->bm_max_peers) {
+			unsigned long word = interleaved_word32(bitmap, bitmap_index, bit);
+			unsigned int count;
+			__le32 *p;
+
+			if (word32_to_page(word) != page) {
+				if (addr) {
+					drbd_kunmap_atomic(addr, KM_IRQ1);
+					if (page_changed)
+						bm_set_page_changed(bitmap->bm_pages[page], op);
+					page_changed = false;
+				}
+				page = word32_to_page(word);
+				addr = drbd_kmap_atomic(bitmap->bm_pages[page], KM_IRQ1);
+			}
+			p = addr + word32_in_page(word);
+
+			if (op == BM_OP_SET) {
+				count = hweight32(~*p & bits);
+				*p |= bits;
+			} else {
+				count = hweight32(*p & bits);
+				*p &= ~bits;
+			}
+			if (count) {
+				changed[bitmap_index] += count;
+				page_changed = true;
+			}
+		}
+	}
+	if (addr) {
+		drbd_kunmap_atomic(addr, KM_IRQ1);
+		if (page_changed)
+			bm_set_page_changed(bitmap->bm_pages[page], op);
+	}
+
+	for_each_set_bit(bitmap_index, &mask, bitmap->bm_max_peers) {
+		if (!changed[bitmap_index])
+			continue;
+		if (op == BM_OP_SET) {
+			bitmap->bm_set[bitmap_index] += changed[bitmap_index];
+			bm_summary_mark(bitmap, bitmap_index, start, end);
+		} else {
+			bitmap->bm_set[bitmap_index] -= changed[bitmap_index];
+			bm_summary_clear(device, bitmap_index, start, end, KM_IRQ1);
+		}
+	}
+out:
+	spin_unlock_irqrestore(&bitmap->bm_lock, irq_flags);
+}
+
+void drbd_bm_set_bits_mask(struct drbd_device *device, unsigned long mask,
+			   unsigned long start, unsigned long end, unsigned int *changed)
+{
+	bm_op_mask(device, mask, start, end, BM_OP_SET, changed);
+}
+
+void drbd_bm_clear_bits_mask(struct drbd_device *device, unsigned long mask,
+			     unsigned long start, unsigned long end, unsigned int *changed)
+{
+	bm_op_mask(device, mask, start, end, BM_OP_CLEAR, changed);
+}
+
 /* returns bit state
  * wants bitnr, NOT sector.
  * inherently racy... area needs to be locked by means of {al,rs}_lru
@@ -1518,12 +1852,17 @@ void drbd_bm_copy_slot(struct drbd_device *device, unsigned int from_index, unsi
 {
 	struct drbd_bitmap *bitmap = device->bitmap;
 	unsigned long word_nr, from_word_nr, to_word_nr;
-	unsigned int from_page_nr, to_page_nr, current_page_nr;
+	unsigned int from_page_nr, to_page_nr, current_page_nr, dirty_page_nr = -1U;
+	unsigned long *to_summary;
 	u32 data_word, *addr;
 
 	spin_lock_irq(&bitmap->bm_lock);
 
 	bitmap->bm_set[to_index] = 0;
+	/* Built from the words actually copied: the bm_lock is dropped in
+	 * between, and bits may get set in from_index meanwhile. */
+	to_summary = bm_summary(bitmap, to_index);
+	memset(to_summary, 0, bitmap->bm_summary_longs * sizeof(long));
 	current_page_nr = 0;
 	addr = drbd_kmap_atomic(bitmap->bm_pages[current_page_nr], KM_IRQ1);
 	for (word_nr = 0; word_nr < bitmap->bm_words; word_nr += bitmap->bm_max_peers) {
@@ -1556,10 +1895,19 @@ void drbd_bm_copy_slot(struct drbd_device *device, unsigned int from_index, unsi
 			addr = drbd_kmap_atomic(bitmap->bm_pages[current_page_nr], KM_IRQ1);
 		}
 
-		if (addr[word32_in_page(to_word_nr)] != data_word)
-			bm_set_page_need_writeout(bitmap->bm_pages[current_page_nr]);
-		addr[word32_in_page(to_word_nr)] = data_word;
-		bitmap->bm_set[to_index] += hweight32(data_word);
+		if (addr[word32_in_page(to_word_nr)] != data_word) {
+			addr[word32_in_page(to_word_nr)] = data_word;
+			/* one atomic bit op per page, not per changed word */
+			if (dirty_page_nr != current_page_nr) {
+				bm_set_page_need_writeout(bitmap->bm_pages[current_page_nr]);
+				dirty_page_nr = current_page_nr;
+			}
+		}
+		if (data_word) {
+			bitmap->bm_set[to_index] += hweight32(data_word);
+			__set_bit((word_nr / bitmap->bm_max_peers) >> (BM_SUMMARY_SHIFT - 5),
+				  to_summary);
+		}
 	}
 	drbd_kunmap_atomic(addr, KM_IRQ1);
 
@@ -110,7 +110,13 @@ static void print_one_age_or_dash(struct seq_file *m, struct drbd_request *req,
 		unsigned int s = req->rq_state[1 + peer_device->node_id];
 
 		if (s & set_mask && !(s & clear_mask)) {
-			unsigned long jif = now - memberat(req, unsigned long, offset);
+			struct drbd_request_net_jif *net_jif =
+				drbd_req_net_jif(req, peer_device->node_id);
+			unsigned long jif;
+
+			if (!net_jif)
+				continue;
+			jif = now - memberat(net_jif, unsigned long, offset);
 			seq_printf(m, "\t[%d]%d", peer_device->node_id, jiffies_to_msecs(jif));
 			return;
 		}
@@ -135,9 +141,9 @@ static void seq_print_one_request(struct seq_file *m, struct drbd_request *req,
 	seq_print_age_or_dash(m, s & RQ_LOCAL_PENDING, now - req->pre_submit_jif);
 
 #define RQ_HDR_3 "\tsent\tacked\tdone"
-	print_one_age_or_dash(m, req, RQ_NET_SENT, 0, now, offsetof(typeof(*req), pre_send_jif));
-	print_one_age_or_dash(m, req, RQ_NET_SENT, RQ_NET_PENDING, now, offsetof(typeof(*req), acked_jif));
-	print_one_age_or_dash(m, req, RQ_NET_DONE, 0, now, offsetof(typeof(*req), net_done_jif));
+	print_one_age_or_dash(m, req, RQ_NET_SENT, 0, now, offsetof(struct drbd_request_net_jif, pre_send_jif));
+	print_one_age_or_dash(m, req, RQ_NET_SENT, RQ_NET_PENDING, now, offsetof(struct drbd_request_net_jif, acked_jif));
+	print_one_age_or_dash(m, req, RQ_NET_DONE, 0, now, offsetof(struct drbd_request_net_jif, net_done_jif));
 
 #define RQ_HDR_4 "\tstate\n"
 	seq_print_request_state(m, req);
@@ -158,21 +164,25 @@ static void seq_print_resource_pending_meta_io(struct seq_file *m, struct drbd_r
 	seq_puts(m, "minor\tvnr\tstart\tsubmit\tintent\n");
 	rcu_read_lock();
 	idr_for_each_entry(&resource->devices, device, i) {
-		struct drbd_md_io tmp;
-		/* In theory this is racy,
-		 * in the sense that there could have been a
-		 * drbd_md_put_buffer(); drbd_md_get_buffer();
-		 * between accessing these members here.  */
-		tmp = device->md_io;
-		if (atomic_read(&tmp.in_use)) {
-			seq_printf(m, "%u\t%u\t%d\t",
-				device->minor, device->vnr,
-				jiffies_to_msecs(now - tmp.start_jif));
-			if (time_before(tmp.submit_jif, tmp.start_jif))
-				seq_puts(m, "-\t");
-			else
-				seq_printf(m, "%d\t", jiffies_to_msecs(now - tmp.submit_jif));
-			seq_printf(m, "%s\n", tmp.current_use);
+		int b;
+
+		for (b = 0; b < DRBD_MD_IO_BUFFERS; b++) {
+			struct drbd_md_io tmp;
+			/* In theory this is racy,
+			 * in the sense that there could have been a
+			 * drbd_md_put_buffer(); drbd_md_get_buffer();
+			 * between accessing these members here.  */
+			tmp = device->md_io[b];
+			if (atomic_read(&tmp.in_use)) {
+				seq_printf(m, "%u\t%u\t%d\t",
+					device->minor, device->vnr,
+					jiffies_to_msecs(now - tmp.start_jif));
+				if (time_before(tmp.submit_jif, tmp.start_jif))
+					seq_puts(m, "-\t");
+				else
+					seq_printf(m, "%d\t", jiffies_to_msecs(now - tmp.submit_jif));
+				seq_printf(m, "%s\n", tmp.current_use);
+			}
 		}
 	}
 	rcu_read_unlock();
@@ -187,7 +197,7 @@ static void seq_print_waiting_for_AL(struct seq_file *m, struct drbd_resource *r
 	rcu_read_lock();
 	idr_for_each_entry(&resource->devices, device, i) {
 		unsigned long jif;
-		struct drbd_request *req;
+		struct drbd_request *req, *queued;
 		int n = atomic_read(&device->ap_actlog_cnt);
 		if (n) {
 			spin_lock_irq(&device->resource->req_lock);
@@ -195,10 +205,14 @@ static void seq_print_waiting_for_AL(struct seq_file *m, struct drbd_resource *r
 				struct drbd_request, req_pending_master_completion);
 			/* if the oldest request does not wait for the activity log
 			 * it is not interesting for us here */
-			if (req && !(req->rq_state[0] & RQ_IN_ACT_LOG))
-				jif = req->start_jif;
-			else
+			if (req && (req->rq_state[0] & RQ_IN_ACT_LOG))
 				req = NULL;
+			/* not yet picked up by the submitter */
+			queued = drbd_oldest_queued_write(device);
+			if (queued && (!req || time_before(queued->start_jif, req->start_jif)))
+				req = queued;
+			if (req)
+				jif = req->start_jif;
 			spin_unlock_irq(&device->resource->req_lock);
 		}
 		if (n) {
@@ -520,6 +534,35 @@ static int resource_state_twopc_show(struct seq_file *m, void *pos)
 	return 0;
 }
 
+static int resource_al_group_commit_show(struct seq_file *m, void *pos)
+{
+	struct drbd_resource *resource = m->private;
+	struct drbd_device *device;
+	unsigned long batches, transactions;
+	int vnr;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	spin_lock(&resource->al_group.lock);
+	batches = resource->al_group.batches;
+	transactions = resource->al_group.transactions;
+	spin_unlock(&resource->al_group.lock);
+
+	seq_printf(m, "enabled: %s\nbatches: %lu\ntransactions: %lu\n\n",
+		   al_group_commit ? "yes" : "no", batches, transactions);
+
+	/* al_writes relative to written sectors, per volume; rates are
+	 * left to whoever samples this file */
+	seq_puts(m, "vnr\tal_writes\twritten_sectors\n");
+	rcu_read_lock();
+	idr_for_each_entry(&resource->devices, device, vnr)
+		seq_printf(m, "%d\t%u\t%u\n", vnr, device->al_writ_cnt, device->writ_cnt);
+	rcu_read_unlock();
+
+	return 0;
+}
+
 /* simple_positive(file->f_path.dentry) respectively debugfs_positive(),
  * but neither is "reachable" from here.
  * So we have our own inline version of it above.  :-( */
@@ -582,6 +625,7 @@ static const struct file_operations resource_ ## name ## _fops = {	\
 
 drbd_debugfs_resource_attr(in_flight_summary)
 drbd_debugfs_resource_attr(state_twopc)
+drbd_debugfs_resource_attr(al_group_commit)
 
 #define drbd_dcf(top, obj, attr) do {		\
 	dentry = debugfs_create_file(#attr, S_IRUSR|S_IRUSR,	\
@@ -627,6 +671,7 @@ void drbd_debugfs_resource_add(struct drbd_resource *resource)
 	/* debugfs create file */
 	res_dcf(in_flight_summary);
 	res_dcf(state_twopc);
+	res_dcf(al_group_commit);
 
 	return;
 
@@ -651,6 +696,7 @@ void drbd_debugfs_resource_cleanup(struct drbd_resource *resource)
 	 * and call debugfs_remove on all of them separately.
 	 */
 	/* it is ok to call debugfs_remove(NULL) */
+	drbd_debugfs_remove(&resource->debugfs_res_al_group_commit);
 	drbd_debugfs_remove(&resource->debugfs_res_state_twopc);
 	drbd_debugfs_remove(&resource->debugfs_res_in_flight_summary);
 	drbd_debugfs_remove(&resource->debugfs_res_connections);
@@ -799,7 +845,9 @@ static int connection_debug_show(struct seq_file *m, void *ignored)
 	seq_printf(m, "   send.current_epoch_nr: %u (%d)\n", u2, (int)(u2 - u1));
 
 	ull1 = resource->dagtag_sector;
+	spin_lock_irq(&resource->peer_ack_lock);
 	ull2 = resource->last_peer_acked_dagtag;
+	spin_unlock_irq(&resource->peer_ack_lock);
 	seq_printf(m, " resource->dagtag_sector: %llu\n", ull1);
 	seq_printf(m, "  last_peer_acked_dagtag: %llu (%lld)\n", ull2, (long long)(ull2 - ull1));
 	ull2 = connection->send.current_dagtag_sector;
@@ -913,6 +961,10 @@ static int device_oldest_requests_show(struct seq_file *m, void *ignored)
 
 	seq_puts(m, RQ_HDR);
 	spin_lock_irq(&resource->req_lock);
+	/* writes not yet picked up by the submitter */
+	r1 = drbd_oldest_queued_write(device);
+	if (r1)
+		seq_print_one_request(m, r1, now);
 	/* WRITE, then READ */
 	for (i = 1; i >= 0; --i) {
 		r1 = list_first_entry_or_null(&device->pending_master_completion[i],
@@ -986,6 +1038,83 @@ static int device_ed_gen_id_show(struct seq_file *m, void *ignored)
 	return 0;
 }
 
+static int device_submit_queues_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_device *device = m->private;
+	unsigned long queued = 0, lock_contended = 0;
+	int cpu;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 1);
+
+	seq_puts(m, "cpu\tqueued\tlock_contended\n");
+	for_each_possible_cpu(cpu) {
+		struct submit_queue *queue = per_cpu_ptr(device->submit.queues, cpu);
+
+		if (!queue->queued)
+			continue;
+		seq_printf(m, "%d\t%lu\t%lu\n", cpu,
+			   queue->queued, queue->lock_contended);
+		queued += queue->queued;
+		lock_contended += queue->lock_contended;
+	}
+	seq_printf(m, "total\t%lu\t%lu\n", queued, lock_contended);
+	seq_printf(m, "merges: %lu\n", device->submit.merges);
+	seq_printf(m, "coalesced: %lu\n", device->submit.coalesced);
+	return 0;
+}
+
+/* One row per bucket: its lower bound in ns, and the counts of all stages */
+static void seq_print_lat_hists(struct seq_file *m, struct drbd_lat_hist __percpu *hists,
+				const char * const *names, int nr_stages)
+{
+	int cpu, s, b;
+
+	seq_puts(m, "ns");
+	for (s = 0; s < nr_stages; s++)
+		seq_printf(m, "\t%s", names[s]);
+	seq_putc(m, '\n');
+
+	for (b = 0; b < DRBD_LAT_BUCKETS; b++) {
+		seq_printf(m, "%llu", b ? 1ULL << (b + 9) : 0ULL);
+		for (s = 0; s < nr_stages; s++) {
+			u64 sum = 0;
+
+			for_each_possible_cpu(cpu)
+				sum += per_cpu_ptr(hists, cpu)[s].count[b];
+			seq_printf(m, "\t%llu", (unsigned long long)sum);
+		}
+		seq_putc(m, '\n');
+	}
+}
+
+static int device_latency_show(struct seq_file *m, void *ignored)
+{
+	static const char * const names[LAT_DEVICE_STAGES] = {
+		[LAT_AL] = "al",
+		[LAT_LOCAL] = "local",
+		[LAT_TOTAL] = "total",
+	};
+	struct drbd_device *device = m->private;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	seq_print_lat_hists(m, &device->lat->stage[0], names, LAT_DEVICE_STAGES);
+	return 0;
+}
+
+static int device_read_cache_show(struct seq_file *m, void *ignored)
+{
+	struct drbd_device *device = m->private;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	drbd_read_cache_seq_printf_stats(m, device);
+	return 0;
+}
+
 static int device_attr_release(struct inode *inode, struct file *file)
 {
 	struct drbd_device *device = inode->i_private;
@@ -1013,6 +1142,9 @@ drbd_debugfs_device_attr(act_log_extents)
 drbd_debugfs_device_attr(data_gen_id)
 drbd_debugfs_device_attr(io_frozen)
 drbd_debugfs_device_attr(ed_gen_id)
+drbd_debugfs_device_attr(submit_queues)
+drbd_debugfs_device_attr(read_cache)
+drbd_debugfs_device_attr(latency)
 
 void drbd_debugfs_device_add(struct drbd_device *device)
 {
@@ -1050,6 +1182,9 @@ void drbd_debugfs_device_add(struct drbd_device *device)
 	vol_dcf(data_gen_id);
 	vol_dcf(io_frozen);
 	vol_dcf(ed_gen_id);
+	vol_dcf(submit_queues);
+	vol_dcf(read_cache);
+	vol_dcf(latency);
 
 	/* Caller holds conf_update */
 	for_each_peer_device(peer_device, device) {
@@ -1072,6 +1207,9 @@ void drbd_debugfs_device_cleanup(struct drbd_device *device)
 	drbd_debugfs_remove(&device->debugfs_vol_data_gen_id);
 	drbd_debugfs_remove(&device->debugfs_vol_io_frozen);
 	drbd_debugfs_remove(&device->debugfs_vol_ed_gen_id);
+	drbd_debugfs_remove(&device->debugfs_vol_submit_queues);
+	drbd_debugfs_remove(&device->debugfs_vol_read_cache);
+	drbd_debugfs_remove(&device->debugfs_vol_latency);
 	drbd_debugfs_remove(&device->debugfs_vol);
 }
 
@@ -1142,6 +1280,21 @@ static int peer_device_resync_extents_show(struct seq_file *m, void *ignored)
 	return 0;
 }
 
+static int peer_device_latency_show(struct seq_file *m, void *ignored)
+{
+	static const char * const names[LAT_PEER_STAGES] = {
+		[LAT_SEND] = "send",
+		[LAT_ACK] = "ack",
+	};
+	struct drbd_peer_device *peer_device = m->private;
+
+	/* BUMP me if you change the file format/content/presentation */
+	seq_printf(m, "v: %u\n\n", 0);
+
+	seq_print_lat_hists(m, &peer_device->lat->stage[0], names, LAT_PEER_STAGES);
+	return 0;
+}
+
 #define drbd_debugfs_peer_device_attr(name)					\
 static int peer_device_ ## name ## _open(struct inode *inode, struct file *file)\
 {										\
@@ -1166,6 +1319,7 @@ static const struct file_operations peer_device_ ## name ## _fops = {		\
 };
 
 drbd_debugfs_peer_device_attr(resync_extents)
+drbd_debugfs_peer_device_attr(latency)
 
 void drbd_debugfs_peer_device_add(struct drbd_peer_device *peer_device)
 {
@@ -1184,6 +1338,7 @@ void drbd_debugfs_peer_device_add(struct drbd_peer_device *peer_device)
 
 	/* debugfs create file */
 	peer_dev_dcf(resync_extents);
+	peer_dev_dcf(latency);
 	return;
 
 fail:
@@ -1194,6 +1349,7 @@ fail:
 void drbd_debugfs_peer_device_cleanup(struct drbd_peer_device *peer_device)
 {
 	drbd_debugfs_remove(&peer_device->debugfs_peer_dev_resync_extents);
+	drbd_debugfs_remove(&peer_device->debugfs_peer_dev_latency);
 	drbd_debugfs_remove(&peer_device->debugfs_peer_dev);
 }
 
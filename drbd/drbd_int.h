@@ -40,6 +40,7 @@
 #include <linux/idr.h>
 #include <linux/lru_cache.h>
 #include <linux/prefetch.h>
+#include <linux/percpu.h>
 #include <linux/drbd_genl_api.h>
 #include <linux/drbd.h>
 #include <linux/drbd_config.h>
@@ -52,6 +53,10 @@
 #include "drbd_kref_debug.h"
 #include "drbd_transport.h"
 
+#ifdef COMPAT_HAVE_BLK_MQ
+#include <linux/blk-mq.h>
+#endif
+
 #ifdef __CHECKER__
 # define __protected_by(x)       __attribute__((require_context(x,1,999,"rdwr")))
 # define __protected_read_by(x)  __attribute__((require_context(x,1,999,"read")))
@@ -81,6 +86,17 @@
 
 /* module parameter, defined in drbd_main.c */
 extern unsigned int minor_count;
+extern unsigned int read_cache_blocks;
+extern bool coalesce_writes;
+extern bool al_group_commit;
+extern bool pipeline_al_commits;
+extern bool al_autosize;
+extern unsigned int al_prefetch_extents;
+extern bool al_dax;
+extern bool al_compact;
+#ifdef COMPAT_HAVE_BLK_MQ
+extern bool use_blk_mq;
+#endif
 extern bool disable_sendpage;
 extern bool allow_oos;
 
@@ -118,6 +134,8 @@ extern char usermode_helper[];
 
 struct drbd_device;
 struct drbd_connection;
+struct drbd_read_cache;
+struct seq_file;
 
 /* I want to be able to grep for "drbd $resource_name"
  * and get all relevant log lines. */
@@ -395,6 +413,47 @@ extern u64 directly_connected_nodes(struct drbd_resource *, enum which_state);
 	 typecheck(u64, b) && \
 	((s64)(a) - (s64)(b) > 0))
 
+struct drbd_request_net_jif {
+	unsigned long pre_send_jif;
+	unsigned long acked_jif;
+	unsigned long net_done_jif;
+	ktime_t pre_send_kt;	/* for the LAT_ACK histogram */
+};
+
+/* Request latency histograms, per device and per peer device, with per cpu
+ * counters.  Bucket 0 counts everything below 1024ns, bucket n > 0 counts
+ * latencies of [2^(n+9), 2^(n+10)) ns.  The last one also counts everything
+ * above, it starts at about 4.3 seconds. */
+#define DRBD_LAT_BUCKETS	24
+
+enum drbd_lat_stage {
+	LAT_AL,		/* start to activity log ready, writes only */
+	LAT_LOCAL,	/* local disk submit to completion */
+	LAT_TOTAL,	/* start to master bio completion */
+	LAT_DEVICE_STAGES,
+};
+
+enum drbd_peer_lat_stage {
+	LAT_SEND,	/* start to handing it to the sender */
+	LAT_ACK,	/* sent to acked by the peer */
+	LAT_PEER_STAGES,
+};
+
+struct drbd_lat_hist {
+	u64 count[DRBD_LAT_BUCKETS];
+};
+
+struct drbd_device_lat {
+	struct drbd_lat_hist stage[LAT_DEVICE_STAGES];
+};
+
+struct drbd_peer_device_lat {
+	struct drbd_lat_hist stage[LAT_PEER_STAGES];
+};
+
+/* requests of resources with node ids below this come from the small pool */
+#define DRBD_SMALL_REQ_NET_JIF	4
+
 struct drbd_request {
 	struct drbd_device *device;
 
@@ -434,6 +493,7 @@ struct drbd_request {
 
 	/* for generic IO accounting */
 	unsigned long start_jif;
+	unsigned int coalesced;	/* requests merged into this one, accounted on completion */
 
 	/* for DRBD internal statistics */
 
@@ -448,10 +508,20 @@ struct drbd_request {
 	/* local disk */
 	unsigned long pre_submit_jif;
 
-	/* per connection */
-	unsigned long pre_send_jif[DRBD_PEERS_MAX];
-	unsigned long acked_jif[DRBD_PEERS_MAX];
-	unsigned long net_done_jif[DRBD_PEERS_MAX];
+	/* when a read was dispatched, locally or to a peer,
+	 * for the latency estimates of RB_LEAST_LATENCY */
+	ktime_t read_kt;
+
+	/* nanosecond clock versions of start_jif and pre_submit_jif,
+	 * for the latency histograms */
+	ktime_t start_kt;
+	ktime_t pre_submit_kt;
+
+	/* read cache sequence number when a read was sent to a peer,
+	 * see drbd_read_cache_fill() */
+	unsigned int read_cache_seq;
+
+	/* per connection: see net_jif[] below */
 
 	/* Possibly even more detail to track each phase:
 	 *  master_completion_jif
@@ -493,8 +563,22 @@ struct drbd_request {
 	/* rq_state[0] is for local disk,
 	 * rest is indexed by peer_device->bitmap_index + 1 */
 	unsigned rq_state[1 + DRBD_NODE_ID_MAX];
+
+	/* Per connection time stamps, indexed by peer node id.
+	 * Most resources only use low node ids, so the tail is sized when the
+	 * request is allocated, see drbd_req_new().  A connection established
+	 * later with a higher node id may find no slot here;
+	 * use drbd_req_net_jif(), never index net_jif[] directly. */
+	unsigned int nr_net_jif;
+	struct drbd_request_net_jif net_jif[0];
 };
 
+static inline struct drbd_request_net_jif *
+drbd_req_net_jif(struct drbd_request *req, int node_id)
+{
+	return node_id < req->nr_net_jif ? &req->net_jif[node_id] : NULL;
+}
+
 struct drbd_epoch {
 	struct drbd_connection *connection;
 	struct list_head list;
@@ -664,6 +748,7 @@ enum {
  * and drbd_bitmap_io and friends. */
 enum bm_flag {
 	BM_P_VMALLOCED = 0x10000,  /* do we need to kfree or vfree bm_pages? */
+	BM_S_VMALLOCED = 0x20000,  /* do we need to kfree or vfree bm_summary? */
 
 	/*
 	 * The bitmap can be locked to prevent others from clearing, setting,
@@ -696,6 +781,11 @@ struct drbd_bitmap {
 	sector_t bm_dev_capacity;
 	struct mutex bm_change; /* serializes resize operations */
 
+	/* one bit per BM_SUMMARY_BITS bits of each peer's bitmap,
+	 * set if that part of the bitmap has any bit set */
+	unsigned long *bm_summary;
+	unsigned long bm_summary_longs; /* per peer */
+
 	wait_queue_head_t bm_io_wait; /* used to serialize IO of single pages */
 
 	enum bm_flag bm_flags;
@@ -754,7 +844,26 @@ struct drbd_backing_dev {
 	sector_t known_size; /* last known size of that backing device */
 };
 
+/* With several AL stripes, one commit may consist of up to this many
+ * consecutive transactions, written concurrently to different stripes.
+ * See drbd_al_tr_per_commit() */
+#define AL_TR_PER_COMMIT_MAX	4
+
+/* Meta data I/O buffers of a device, so that super block updates and
+ * activity log transactions do not wait for each other.
+ * Ordering: whoever needs both takes DRBD_MD_IO_SB first.  The activity log
+ * takes DRBD_MD_IO_AL, then the further AL buffers in ascending order, with
+ * the act_log transaction lock held, and never DRBD_MD_IO_SB. */
+enum drbd_md_io_buffer {
+	DRBD_MD_IO_SB,		/* super block, drbd_md_write(), drbd_md_read() */
+	DRBD_MD_IO_AL,		/* AL transactions, drbd_initialize_al() */
+	/* further transactions of one commit, see al_write_transactions() */
+	DRBD_MD_IO_AL_LAST = DRBD_MD_IO_AL + AL_TR_PER_COMMIT_MAX - 1,
+	DRBD_MD_IO_BUFFERS
+};
+
 struct drbd_md_io {
+	struct drbd_device *device;	/* for drbd_md_endio() */
 	struct page *page;
 	unsigned long start_jif;	/* last call to drbd_md_get_buffer */
 	unsigned long submit_jif;	/* last _drbd_md_sync_page_io() submit */
@@ -764,6 +873,35 @@ struct drbd_md_io {
 	int error;
 };
 
+/* cross volume activity log group commit, see al_group_write_transaction() */
+struct drbd_al_group {
+	spinlock_t lock;
+	struct list_head queued;	/* devices with a prepared transaction */
+	bool committing;		/* a batch is in flight */
+	wait_queue_head_t wait;
+	unsigned long batches;
+	unsigned long transactions;
+};
+
+/* working set telemetry of the activity log, see al_account_get() */
+#define AL_GHOST_BITS 12
+struct al_ghost {
+	unsigned int enr;
+	unsigned int idle_since;
+};
+
+struct drbd_al_reuse {
+	unsigned int idle_seq;		/* counts AL extents becoming idle */
+	unsigned int activations;	/* since the last recommendation */
+	struct al_ghost *ghost;		/* recently evicted, 1 << AL_GHOST_BITS */
+	u64 hist[DRBD_AL_REUSE_BUCKETS];	/* AL size needed to reuse, log2 */
+	u64 cold;
+	unsigned int recommended;
+};
+
+/* AL extents activated ahead of a sequential writer, see al_prefetch_locked() */
+#define AL_PREFETCH_MAX 8
+
 struct bm_io_work {
 	struct drbd_work w;
 	struct drbd_device *device;
@@ -867,6 +1005,7 @@ struct drbd_resource {
 	struct dentry *debugfs_res_connections;
 	struct dentry *debugfs_res_in_flight_summary;
 	struct dentry *debugfs_res_state_twopc;
+	struct dentry *debugfs_res_al_group_commit;
 #endif
 	struct kref kref;
 	struct kref_debug_info kref_debug;
@@ -886,6 +1025,11 @@ struct drbd_resource {
 
 	struct list_head transfer_log;	/* all requests not yet fully processed */
 
+	/* Lock order: req_lock, then peer_ack_lock.
+	 * Once a request has been handed to the peer ack machinery,
+	 * it is only reachable through these members, so the ack_sender
+	 * can process the peer_ack_list without taking the req_lock. */
+	spinlock_t peer_ack_lock;
 	struct list_head peer_ack_list;  /* requests to send peer acks for */
 	u64 last_peer_acked_dagtag;  /* dagtag of last PEER_ACK'ed request */
 	struct drbd_request *peer_ack_req;  /* last request not yet PEER_ACK'ed */
@@ -919,6 +1063,8 @@ struct drbd_resource {
 #else
 	cpumask_var_t cpu_mask;
 #endif
+	int numa_node;			/* of the most recently attached backing device */
+	struct drbd_al_group al_group;
 
 	struct drbd_work_queue work;
 	struct drbd_thread worker;
@@ -1105,6 +1251,11 @@ struct drbd_peer_device {
 	int bitmap_index;
 	int node_id;
 
+	/* read latency estimate, see drbd_update_read_latency() */
+	unsigned long read_lat_ewma;
+
+	struct drbd_peer_device_lat __percpu *lat;
+
 	unsigned long flags;
 
 	enum drbd_repl_state start_resync_side;
@@ -1182,15 +1333,30 @@ struct drbd_peer_device {
 #ifdef CONFIG_DEBUG_FS
 	struct dentry *debugfs_peer_dev;
 	struct dentry *debugfs_peer_dev_resync_extents;
+	struct dentry *debugfs_peer_dev_latency;
 #endif
 };
 
+/* Incoming writes are queued per cpu, so that submitters on different
+ * cores do not serialize on one list lock.  do_submit() merges them all.
+ * The counters are statistics only, and are exposed via debugfs. */
+struct submit_queue {
+	spinlock_t lock;
+	struct list_head writes;
+
+	unsigned long queued;		/* writes queued on this cpu */
+	unsigned long lock_contended;	/* this queue was busy being drained */
+};
+
 struct submit_worker {
 	struct workqueue_struct *wq;
 	struct work_struct worker;
 
-	/* protected by ..->resource->req_lock */
-	struct list_head writes;
+	struct submit_queue __percpu *queues;
+	cpumask_var_t pending_cpus;	/* cpus that may have queued writes */
+	sector_t queued_end;		/* end of the last queued write, a hint for coalescing */
+	unsigned long merges;		/* do_submit() calls to grab incoming writes */
+	unsigned long coalesced;	/* writes merged into their predecessor */
 };
 
 struct drbd_device {
@@ -1210,6 +1376,9 @@ struct drbd_device {
 	struct dentry *debugfs_vol_data_gen_id;
 	struct dentry *debugfs_vol_io_frozen;
 	struct dentry *debugfs_vol_ed_gen_id;
+	struct dentry *debugfs_vol_submit_queues;
+	struct dentry *debugfs_vol_read_cache;
+	struct dentry *debugfs_vol_latency;
 #endif
 
 	unsigned int vnr;	/* volume number within the connection */
@@ -1227,6 +1396,13 @@ struct drbd_device {
 	struct request_queue *rq_queue;
 	struct block_device *this_bdev;
 	struct gendisk	    *vdisk;
+#ifdef COMPAT_HAVE_BLK_MQ
+	/* only used with use_blk_mq, see drbd_mq_queue_rq() */
+	struct blk_mq_tag_set tag_set;
+#ifndef COMPAT_HAVE_BLK_MQ_F_BLOCKING
+	struct workqueue_struct *mq_wq;
+#endif
+#endif
 
 	unsigned long last_reattach_jif;
 	struct timer_list md_sync_timer;
@@ -1249,9 +1425,22 @@ struct drbd_device {
 	atomic_t local_cnt;	 /* Waiting for local completion */
 	atomic_t suspend_cnt;
 
-	/* Interval trees of pending local requests */
+	/* RB_LEAST_LATENCY read balancing, protected by resource->req_lock */
+	unsigned long read_lat_ewma;	/* local disk, see drbd_update_read_latency() */
+	int read_lat_node_id;		/* current read target, -1 for local disk */
+	unsigned int read_lat_reads;	/* to probe the other targets now and then */
+
+	struct drbd_device_lat __percpu *lat;
+
+	/* Interval trees of pending local requests.
+	 * Lock order: resource->req_lock, then interval_lock.
+	 * Changes to the trees and the write_filter hold both locks, so
+	 * looking something up needs either of them. */
+	spinlock_t interval_lock;
 	struct rb_root read_requests;
 	struct rb_root write_requests;
+	struct drbd_interval_filter write_filter;
+	struct work_struct write_filter_work;	/* see drbd_insert_write_interval() */
 
 	/* for statistics and timeouts */
 	/* [0] read, [1] write */
@@ -1274,12 +1463,25 @@ struct drbd_device {
 
 	int next_barrier_nr;
 	wait_queue_head_t ee_wait;
-	struct drbd_md_io md_io;
+	struct drbd_md_io md_io[DRBD_MD_IO_BUFFERS];
 	spinlock_t al_lock;
 	wait_queue_head_t al_wait;
 	struct lru_cache *act_log;	/* activity log */
 	unsigned int al_tr_number;
 	int al_tr_cycle;
+	/* al_group_write_transaction(), protected by resource->al_group.lock */
+	struct list_head al_group_list;
+	struct bio *al_group_bio;
+	sector_t al_group_sector;
+	int al_group_err;
+	bool al_group_done;
+	struct bio *al_commit_bio;	/* see drbd_al_commit_start() */
+	struct drbd_al_reuse al_reuse;	/* protected by al_lock */
+	/* sequential write stream detection, see al_prefetch_locked() */
+	sector_t al_seq_next;
+	unsigned int al_prefetched;	/* activated up to this extent */
+	unsigned int al_prefetch_held_nr;	/* protected by al_lock */
+	struct lc_element *al_prefetch_held[AL_PREFETCH_MAX];
 	wait_queue_head_t seq_wait;
 	u64 exposed_data_uuid; /* UUID of the exposed data */
 	u64 next_exposed_data_uuid;
@@ -1294,6 +1496,9 @@ struct drbd_device {
 	/* any requests that would block in drbd_make_request()
 	 * are deferred to this single-threaded work queue */
 	struct submit_worker submit;
+
+	/* only allocated if the read_cache_blocks module parameter is set */
+	struct drbd_read_cache *read_cache;
 };
 
 struct drbd_bm_aio_ctx {
@@ -1581,6 +1786,14 @@ __drbd_next_peer_device_ref(u64 *, struct drbd_peer_device *, struct drbd_device
 #define AL_UPDATES_PER_TRANSACTION	 64	// arbitrary
 #define AL_CONTEXT_PER_TRANSACTION	919	// (4096 - 36 - 6*64)/4
 
+/* The compact transaction format (MDF_AL_COMPACT) stores each update as a
+ * 16 bit slot number followed by the varint encoded delta to the previous
+ * extent number, at most 7 byte per update.  Whatever the updates leave
+ * of the block is used for context, at least AL_COMPACT_CONTEXT_MIN slots.
+ * See drbd_actlog.c:struct al_compact_transaction_on_disk */
+#define AL_COMPACT_UPDATES_PER_TRANSACTION	256
+#define AL_COMPACT_CONTEXT_MIN		567	// (4096 - 36 - 7*256)/4
+
 /* drbd_bitmap.c */
 /*
  * We need to store one bit for a block.
@@ -1698,6 +1911,11 @@ extern void drbd_bm_clear_all(struct drbd_device *device);
 /* set/clear/test only a few bits at a time */
 extern unsigned int drbd_bm_set_bits(struct drbd_device *, unsigned int, unsigned long, unsigned long);
 extern unsigned int drbd_bm_clear_bits(struct drbd_device *, unsigned int, unsigned long, unsigned long);
+/* the same for all bitmap indexes in a mask, in one pass over the bitmap */
+extern void drbd_bm_set_bits_mask(struct drbd_device *, unsigned long, unsigned long, unsigned long,
+				  unsigned int *);
+extern void drbd_bm_clear_bits_mask(struct drbd_device *, unsigned long, unsigned long, unsigned long,
+				    unsigned int *);
 extern int drbd_bm_count_bits(struct drbd_device *, unsigned int, unsigned long, unsigned long);
 /* bm_set_bits variant for use while holding drbd_bm_lock,
  * may process the whole bitmap in one go */
@@ -1738,10 +1956,12 @@ extern void drbd_bm_copy_slot(struct drbd_device *device, unsigned int from_inde
 /* drbd_main.c */
 
 extern struct kmem_cache *drbd_request_cache;
+extern struct kmem_cache *drbd_small_request_cache;
 extern struct kmem_cache *drbd_ee_cache;	/* peer requests */
 extern struct kmem_cache *drbd_bm_ext_cache;	/* bitmap extents */
 extern struct kmem_cache *drbd_al_ext_cache;	/* activity log extents */
 extern mempool_t *drbd_request_mempool;
+extern mempool_t *drbd_small_request_mempool;
 extern mempool_t *drbd_ee_mempool;
 
 /* drbd's page pool, used to buffer data received from the peer,
@@ -1757,9 +1977,17 @@ extern mempool_t *drbd_ee_mempool;
  * frequent calls to alloc_page(), and still will be able to make progress even
  * under memory pressure.
  */
-extern struct page *drbd_pp_pool;
-extern spinlock_t   drbd_pp_lock;
-extern int	    drbd_pp_vacant;
+struct drbd_page_pool {
+	spinlock_t lock;
+	struct page *pages;
+	int vacant;
+} ____cacheline_aligned_in_smp;
+
+/* One pool per NUMA node, indexed by node id. Pages are taken from
+ * the pool of the allocating CPU's node, and given back to the pool of
+ * the node they live on. */
+extern struct drbd_page_pool *drbd_pp_pools;
+extern int drbd_pp_pool_size;
 extern wait_queue_head_t drbd_pp_wait;
 
 /* We also need a standard (emergency-reserve backed) page pool
@@ -1792,6 +2020,7 @@ extern void drbd_free_resource(struct drbd_resource *resource);
 extern void drbd_destroy_device(struct kref *kref);
 
 extern int set_resource_options(struct drbd_resource *resource, struct res_opts *res_opts);
+extern void drbd_resource_set_numa_node(struct drbd_resource *resource, int node);
 extern struct drbd_connection *drbd_create_connection(struct drbd_resource *resource,
 						      struct drbd_transport_class *tc);
 extern void drbd_transport_shutdown(struct drbd_connection *connection, enum drbd_tr_free_op op);
@@ -1806,6 +2035,20 @@ extern void __drbd_make_request(struct drbd_device *, struct bio *, unsigned lon
 extern MAKE_REQUEST_TYPE drbd_make_request(struct request_queue *q, struct bio *bio);
 extern int drbd_merge_bvec(struct request_queue *, struct bvec_merge_data *, struct bio_vec *);
 extern int is_valid_ar_handle(struct drbd_request *, sector_t);
+#ifdef COMPAT_HAVE_BLK_MQ
+extern struct request_queue *drbd_mq_alloc_queue(struct drbd_device *);
+extern void drbd_mq_free_queue(struct drbd_device *);
+#endif
+
+/* drbd_read_cache.c */
+extern bool drbd_read_cache_lookup(struct drbd_device *, struct bio *);
+extern void drbd_read_cache_fill(struct drbd_device *, struct drbd_request *);
+extern unsigned int drbd_read_cache_seq(struct drbd_device *);
+extern void drbd_read_cache_invalidate(struct drbd_device *, sector_t, unsigned int);
+extern void drbd_read_cache_clear(struct drbd_device *);
+extern int drbd_read_cache_alloc(struct drbd_device *);
+extern void drbd_read_cache_free(struct drbd_device *);
+extern void drbd_read_cache_seq_printf_stats(struct seq_file *, struct drbd_device *);
 
 
 /* drbd_nl.c */
@@ -1847,10 +2090,12 @@ extern void resume_next_sg(struct drbd_device *device);
 extern void suspend_other_sg(struct drbd_device *device);
 extern int drbd_resync_finished(struct drbd_peer_device *, enum drbd_disk_state);
 /* maybe rather drbd_main.c ? */
-extern void *drbd_md_get_buffer(struct drbd_device *device, const char *intent);
-extern void drbd_md_put_buffer(struct drbd_device *device);
+extern void *drbd_md_get_buffer(struct drbd_device *device, enum drbd_md_io_buffer which,
+				const char *intent);
+extern void drbd_md_put_buffer(struct drbd_device *device, enum drbd_md_io_buffer which);
 extern int drbd_md_sync_page_io(struct drbd_device *device,
-		struct drbd_backing_dev *bdev, sector_t sector, int rw);
+		struct drbd_backing_dev *bdev, enum drbd_md_io_buffer which,
+		sector_t sector, int rw);
 extern void drbd_ov_out_of_sync_found(struct drbd_peer_device *, sector_t, int);
 extern void wait_until_done_or_force_detached(struct drbd_device *device,
 		struct drbd_backing_dev *bdev, unsigned int *done);
@@ -2006,7 +2251,10 @@ extern const struct file_operations drbd_proc_fops;
 extern bool drbd_al_begin_io_prepare(struct drbd_device *device, struct drbd_interval *i);
 extern int drbd_al_begin_io_nonblock(struct drbd_device *device, struct drbd_interval *i);
 extern void drbd_al_begin_io_commit(struct drbd_device *device);
+extern bool drbd_al_commit_start(struct drbd_device *device);
+extern void drbd_al_commit_wait(struct drbd_device *device);
 extern bool drbd_al_begin_io_fastpath(struct drbd_device *device, struct drbd_interval *i);
+extern void drbd_al_prefetch_release(struct drbd_device *device);
 extern void drbd_al_begin_io(struct drbd_device *device, struct drbd_interval *i);
 extern void drbd_al_begin_io_for_peer(struct drbd_peer_device *peer_device, struct drbd_interval *i);
 extern void drbd_al_complete_io(struct drbd_device *device, struct drbd_interval *i);
@@ -2030,7 +2278,9 @@ extern int __drbd_change_sync(struct drbd_peer_device *peer_device, sector_t sec
 	__drbd_change_sync(peer_device, sector, size, RECORD_RS_FAILED)
 extern void drbd_al_shrink(struct drbd_device *device);
 extern bool drbd_sector_has_priority(struct drbd_peer_device *, sector_t);
-extern int drbd_initialize_al(struct drbd_device *, void *);
+extern int drbd_initialize_al(struct drbd_device *);
+extern unsigned int drbd_al_tr_per_commit(struct drbd_backing_dev *bdev);
+extern unsigned int drbd_al_max_pending_changes(struct drbd_backing_dev *bdev);
 
 /* drbd_nl.c */
 
@@ -2726,6 +2976,12 @@ static inline void drbd_kick_lo(struct drbd_device *device)
 
 /* resync bitmap */
 /* 128MB sized 'bitmap extent' to track syncer usage */
+/* activity log extent */
+struct al_extent {
+	struct lc_element lce;
+	unsigned int idle_since; /* al_reuse.idle_seq when its refcnt dropped to 0 */
+};
+
 struct bm_extent {
 	int rs_left; /* number of bits set (out of sync) in this extent. */
 	int rs_failed; /* number of failed resync requests in this extent. */
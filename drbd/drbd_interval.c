@@ -1,3 +1,4 @@
+#include <linux/vmalloc.h>
 #include "drbd_interval.h"
 #include "drbd_wrappers.h"
 
@@ -176,3 +177,135 @@ drbd_next_overlap(struct drbd_interval *i, sector_t sector, unsigned int size)
 			return i;
 	}
 }
+
+/*
+ * Chunks touched by an interval.  Like drbd_find_overlap(), an empty interval
+ * may still overlap the sector it starts in.
+ */
+static unsigned long filter_chunks(struct drbd_interval_filter *f,
+				   sector_t sector, unsigned int size, unsigned long *first)
+{
+	sector_t first_chunk = sector >> DRBD_IFILTER_CHUNK_SHIFT;
+	sector_t last_chunk = (sector + max(size >> 9, 1U) - 1) >> DRBD_IFILTER_CHUNK_SHIFT;
+
+	/* only used modulo the number of slots, truncation does not matter */
+	*first = first_chunk;
+	return min_t(sector_t, last_chunk - first_chunk + 1, 1UL << f->shift);
+}
+
+static void filter_add(struct drbd_interval_filter *f, sector_t sector, unsigned int size, int d)
+{
+	unsigned long mask = (1UL << f->shift) - 1;
+	unsigned long first, nr, n;
+
+	/* removing an interval that was never inserted */
+	BUG_ON(d < 0 && !f->nr);
+	f->nr += d;
+	nr = filter_chunks(f, sector, size, &first);
+	if (nr > mask) {
+		BUG_ON(d < 0 && !f->wide);
+		f->wide += d;
+		return;
+	}
+	for (n = first; n < first + nr; n++) {
+		unsigned int *count = &f->count[n & mask];
+
+		BUG_ON(d < 0 && !*count);
+		*count += d;
+	}
+}
+
+void drbd_filter_init(struct drbd_interval_filter *f)
+{
+	memset(f, 0, sizeof(*f));
+	f->shift = DRBD_IFILTER_MIN_SHIFT;
+	f->count = f->inline_count;
+}
+
+/**
+ * drbd_filter_insert  -  count an interval inserted into the tree
+ *
+ * Returns true if the filter should grow, see drbd_filter_resize().
+ */
+bool drbd_filter_insert(struct drbd_interval_filter *f, sector_t sector, unsigned int size)
+{
+	filter_add(f, sector, size, 1);
+	return f->shift < DRBD_IFILTER_MAX_SHIFT && f->nr > (1U << f->shift) / 2;
+}
+
+void drbd_filter_remove(struct drbd_interval_filter *f, sector_t sector, unsigned int size)
+{
+	filter_add(f, sector, size, -1);
+}
+
+/**
+ * drbd_filter_may_overlap  -  check if the tree may contain an overlap
+ *
+ * Returns false only if the tree behind @f certainly has no interval
+ * overlapping with [sector, sector + size).
+ */
+bool drbd_filter_may_overlap(struct drbd_interval_filter *f, sector_t sector, unsigned int size)
+{
+	unsigned long mask = (1UL << f->shift) - 1;
+	unsigned long first, nr, n;
+
+	if (f->wide)
+		return true;
+	nr = filter_chunks(f, sector, size, &first);
+	if (nr > mask)
+		return true;
+	for (n = first; n < first + nr; n++)
+		if (f->count[n & mask])
+			return true;
+	return false;
+}
+
+/* Slots for a filter of 1 << @shift slots, to be passed to drbd_filter_resize().
+ * May sleep. */
+unsigned int *drbd_filter_alloc_slots(unsigned int shift)
+{
+	return __vmalloc(sizeof(unsigned int) << shift,
+			 GFP_NOIO | __GFP_HIGHMEM | __GFP_ZERO, PAGE_KERNEL);
+}
+
+void drbd_filter_free_slots(struct drbd_interval_filter *f, unsigned int *count)
+{
+	if (count && count != f->inline_count)
+		vfree(count);
+}
+
+void drbd_filter_free(struct drbd_interval_filter *f)
+{
+	drbd_filter_free_slots(f, f->count);
+	f->count = f->inline_count;
+}
+
+/**
+ * drbd_filter_resize  -  switch to zeroed slots for 1 << @shift slots
+ *
+ * Recounts all intervals in @root, which must be exactly those counted in @f.
+ * Does nothing unless @shift is the next larger size.  Returns the slots no
+ * longer in use, for drbd_filter_free_slots() outside of the lock.
+ */
+unsigned int *drbd_filter_resize(struct drbd_interval_filter *f, struct rb_root *root,
+				 unsigned int *count, unsigned int shift)
+{
+	unsigned int *old = f->count;
+	unsigned int nr = f->nr;
+	struct rb_node *node;
+
+	if (shift != f->shift + 1 || shift > DRBD_IFILTER_MAX_SHIFT)
+		return count;
+
+	f->count = count;
+	f->shift = shift;
+	f->wide = 0;
+	f->nr = 0;
+	for (node = rb_first(root); node; node = rb_next(node)) {
+		struct drbd_interval *i = rb_entry(node, struct drbd_interval, rb);
+
+		filter_add(f, i->sector, i->size, 1);
+	}
+	WARN_ON_ONCE(f->nr != nr);
+	return old;
+}
@@ -67,4 +67,41 @@ extern struct drbd_interval *drbd_next_overlap(struct drbd_interval *, sector_t,
 	     i;							\
 	     i = drbd_next_overlap(i, sector, size))
 
+/*
+ * Most lookups in an interval tree find nothing.  An interval filter counts,
+ * for each slot, the intervals touching any of the chunks mapped to that
+ * slot, and so answers most of these lookups without walking the tree.
+ * Chunk n maps to slot n % (1 << shift); intervals touching all slots
+ * are only counted in "wide".
+ *
+ * To keep discriminating with many intervals, the number of slots is kept
+ * at twice the number of intervals or more, up to DRBD_IFILTER_MAX_SHIFT:
+ * drbd_filter_insert() tells when to grow, and drbd_filter_resize() rebuilds
+ * the counts from the tree.
+ *
+ * The filter has to be kept in sync with the tree by the caller, under the
+ * same lock.
+ */
+#define DRBD_IFILTER_CHUNK_SHIFT	8	/* 128 KiB, in sectors */
+#define DRBD_IFILTER_MIN_SHIFT		10	/* 1024 slots, embedded */
+#define DRBD_IFILTER_MAX_SHIFT		20	/* 1M slots, 4 MiB */
+
+struct drbd_interval_filter {
+	unsigned int wide;
+	unsigned int nr;	/* intervals counted */
+	unsigned int shift;
+	unsigned int *count;	/* inline_count, or allocated for a larger shift */
+	unsigned int inline_count[1 << DRBD_IFILTER_MIN_SHIFT];
+};
+
+extern void drbd_filter_init(struct drbd_interval_filter *);
+extern void drbd_filter_free(struct drbd_interval_filter *);
+extern bool drbd_filter_insert(struct drbd_interval_filter *, sector_t, unsigned int);
+extern void drbd_filter_remove(struct drbd_interval_filter *, sector_t, unsigned int);
+extern bool drbd_filter_may_overlap(struct drbd_interval_filter *, sector_t, unsigned int);
+extern unsigned int *drbd_filter_alloc_slots(unsigned int shift);
+extern void drbd_filter_free_slots(struct drbd_interval_filter *, unsigned int *);
+extern unsigned int *drbd_filter_resize(struct drbd_interval_filter *, struct rb_root *,
+					unsigned int *, unsigned int);
+
 #endif  /* __DRBD_INTERVAL_H */
@@ -95,6 +95,26 @@ MODULE_PARM_DESC(allow_oos, "DONT USE!");
 /* thanks to these macros, if compiled into the kernel (not-module),
  * this becomes the boot parameter drbd.minor_count */
 module_param(minor_count, uint, 0444);
+MODULE_PARM_DESC(read_cache_blocks, "Pages per volume to cache recent reads of a diskless primary (0 = off)");
+module_param(read_cache_blocks, uint, 0444);
+MODULE_PARM_DESC(coalesce_writes, "Merge contiguous writes queued to the submitter into one request");
+module_param(coalesce_writes, bool, 0644);
+MODULE_PARM_DESC(al_group_commit, "Write activity log transactions of all volumes of a resource in batches");
+module_param(al_group_commit, bool, 0644);
+MODULE_PARM_DESC(pipeline_al_commits, "Prepare the next activity log transaction while the previous one is written");
+module_param(pipeline_al_commits, bool, 0644);
+MODULE_PARM_DESC(al_autosize, "Limit the activity log to the measured working set, within al-extents");
+module_param(al_autosize, bool, 0644);
+MODULE_PARM_DESC(al_prefetch_extents, "Activity log extents to activate ahead of sequential writers (0 = off)");
+module_param(al_prefetch_extents, uint, 0644);
+MODULE_PARM_DESC(al_dax, "Write activity log transactions with CPU stores if the meta data device supports DAX (pmem)");
+module_param(al_dax, bool, 0644);
+MODULE_PARM_DESC(al_compact, "Use the compact activity log transaction format on newly attached disks whose meta data drbdmeta has enabled it for");
+module_param(al_compact, bool, 0644);
+#ifdef COMPAT_HAVE_BLK_MQ
+MODULE_PARM_DESC(use_blk_mq, "Use a blk-mq request queue for new drbd devices");
+module_param(use_blk_mq, bool, 0644);
+#endif
 module_param(disable_sendpage, bool, 0644);
 module_param(allow_oos, bool, 0);
 
@@ -118,6 +138,17 @@ module_param(two_phase_commit_fail, int, 0644);
 
 /* module parameter, defined */
 unsigned int minor_count = DRBD_MINOR_COUNT_DEF;
+unsigned int read_cache_blocks;
+bool coalesce_writes;
+bool al_group_commit;
+bool pipeline_al_commits;
+bool al_autosize;
+unsigned int al_prefetch_extents;
+bool al_dax;
+bool al_compact;
+#ifdef COMPAT_HAVE_BLK_MQ
+bool use_blk_mq;
+#endif
 bool disable_sendpage;
 bool allow_oos;
 
@@ -134,10 +165,12 @@ struct idr drbd_devices;
 struct list_head drbd_resources;
 
 struct kmem_cache *drbd_request_cache;
+struct kmem_cache *drbd_small_request_cache;
 struct kmem_cache *drbd_ee_cache;	/* peer requests */
 struct kmem_cache *drbd_bm_ext_cache;	/* bitmap extents */
 struct kmem_cache *drbd_al_ext_cache;	/* activity log extents */
 mempool_t *drbd_request_mempool;
+mempool_t *drbd_small_request_mempool;
 mempool_t *drbd_ee_mempool;
 mempool_t *drbd_md_io_page_pool;
 struct bio_set *drbd_md_io_bio_set;
@@ -148,9 +181,8 @@ struct bio_set *drbd_md_io_bio_set;
    Note: This is a single linked list, the next pointer is the private
 	 member of struct page.
  */
-struct page *drbd_pp_pool;
-spinlock_t   drbd_pp_lock;
-int          drbd_pp_vacant;
+struct drbd_page_pool *drbd_pp_pools;
+int drbd_pp_pool_size; /* pages per node */
 wait_queue_head_t drbd_pp_wait;
 
 DEFINE_RATELIMIT_STATE(drbd_ratelimit_state, DEFAULT_RATELIMIT_INTERVAL, DEFAULT_RATELIMIT_BURST);
@@ -324,8 +356,18 @@ void tl_release(struct drbd_connection *connection, unsigned int barrier_nr,
 	spin_lock_irq(&connection->resource->req_lock);
 
 	/* find oldest not yet barrier-acked write request,
-	 * count writes in its epoch. */
-	list_for_each_entry(r, &resource->transfer_log, tl_requests) {
+	 * count writes in its epoch.
+	 *
+	 * The transfer log may be very long (Ahead mode, large peer_ack_window,
+	 * or some other connection lagging behind), but everything in front of
+	 * connection->req_not_net_done is either done for this connection,
+	 * or has not even been sent to it, and can not be covered by this
+	 * barrier ack.  Start the walk there, if we have it. */
+	r = connection->req_not_net_done;
+	if (r)
+		r = list_prev_entry(r, tl_requests);
+	r = list_prepare_entry(r, &resource->transfer_log, tl_requests);
+	list_for_each_entry_continue(r, &resource->transfer_log, tl_requests) {
 		struct drbd_peer_device *peer_device;
 		int idx;
 		peer_device = conn_peer_device(connection, r->device->vnr);
@@ -371,12 +413,15 @@ void tl_release(struct drbd_connection *connection, unsigned int barrier_nr,
 	}
 
 	/* Clean up list of requests processed during current epoch. */
-	/* this extra list walk restart is paranoia,
+	/* this extra list walk back is paranoia,
 	 * to catch requests being barrier-acked "unexpectedly".
-	 * It usually should find the same req again, or some READ preceding it. */
-	list_for_each_entry(req, &resource->transfer_log, tl_requests)
-		if (req->epoch == expect_epoch)
+	 * Epoch numbers only grow along the transfer log, so all requests of
+	 * this epoch are adjacent.  Usually we stay on the same req,
+	 * or step back to some READ preceding it. */
+	list_for_each_entry_continue_reverse(req, &resource->transfer_log, tl_requests)
+		if (req->epoch != expect_epoch)
 			break;
+	req = list_next_entry(req, tl_requests);
 	list_for_each_entry_safe_from(req, r, &resource->transfer_log, tl_requests) {
 		struct drbd_peer_device *peer_device;
 		if (req->epoch != expect_epoch)
@@ -642,14 +687,22 @@ int conn_lowest_minor(struct drbd_connection *connection)
 #ifdef CONFIG_SMP
 /**
  * drbd_calc_cpu_mask() - Generate CPU masks, spread over all CPUs
+ * @cpu_mask:	Where to put the result.
+ * @node:	Preferred NUMA node, or NUMA_NO_NODE.
  *
  * Forces all threads of a resource onto the same CPU. This is beneficial for
  * DRBD's performance. May be overwritten by user's configuration.
+ * If @node has online CPUs, the CPU is chosen among those, so that the
+ * threads run close to the backing device and its memory.
  */
-static void drbd_calc_cpu_mask(cpumask_var_t *cpu_mask)
+static void drbd_calc_cpu_mask(cpumask_var_t *cpu_mask, int node)
 {
+	const struct cpumask *candidates = cpu_online_mask;
 	unsigned int *resources_per_cpu, min_index = ~0;
 
+	if (node != NUMA_NO_NODE && cpumask_intersects(cpumask_of_node(node), cpu_online_mask))
+		candidates = cpumask_of_node(node);
+
 	resources_per_cpu = kzalloc(nr_cpu_ids * sizeof(*resources_per_cpu), GFP_KERNEL);
 	if (resources_per_cpu) {
 		struct drbd_resource *resource;
@@ -661,7 +714,7 @@ static void drbd_calc_cpu_mask(cpumask_var_t *cpu_mask)
 				resources_per_cpu[cpu]++;
 		}
 		rcu_read_unlock();
-		for_each_online_cpu(cpu) {
+		for_each_cpu_and(cpu, candidates, cpu_online_mask) {
 			if (resources_per_cpu[cpu] < min) {
 				min = resources_per_cpu[cpu];
 				min_index = cpu;
@@ -695,7 +748,7 @@ void drbd_thread_current_set_cpu(struct drbd_thread *thi)
 	set_cpus_allowed_ptr(p, resource->cpu_mask);
 }
 #else
-#define drbd_calc_cpu_mask(A) ({})
+#define drbd_calc_cpu_mask(A, B) ({})
 #endif
 
 static bool drbd_all_neighbor_secondary(struct drbd_resource *resource, u64 *authoritative)
@@ -2523,13 +2576,19 @@ void drbd_cleanup_device(struct drbd_device *device)
 static void drbd_destroy_mempools(void)
 {
 	struct page *page;
+	int nid;
+
+	for (nid = 0; drbd_pp_pools && nid < nr_node_ids; nid++) {
+		struct drbd_page_pool *pool = &drbd_pp_pools[nid];
 
-	while (drbd_pp_pool) {
-		page = drbd_pp_pool;
-		drbd_pp_pool = (struct page *)page_private(page);
-		__free_page(page);
-		drbd_pp_vacant--;
+		while (pool->pages) {
+			page = pool->pages;
+			pool->pages = (struct page *)page_private(page);
+			__free_page(page);
+			pool->vacant--;
+		}
 	}
+	kfree(drbd_pp_pools);
 
 	/* D_ASSERT(device, atomic_read(&drbd_pp_vacant)==0); */
 
@@ -2541,10 +2600,14 @@ static void drbd_destroy_mempools(void)
 		mempool_destroy(drbd_ee_mempool);
 	if (drbd_request_mempool)
 		mempool_destroy(drbd_request_mempool);
+	if (drbd_small_request_mempool)
+		mempool_destroy(drbd_small_request_mempool);
 	if (drbd_ee_cache)
 		kmem_cache_destroy(drbd_ee_cache);
 	if (drbd_request_cache)
 		kmem_cache_destroy(drbd_request_cache);
+	if (drbd_small_request_cache)
+		kmem_cache_destroy(drbd_small_request_cache);
 	if (drbd_bm_ext_cache)
 		kmem_cache_destroy(drbd_bm_ext_cache);
 	if (drbd_al_ext_cache)
@@ -2554,8 +2617,10 @@ static void drbd_destroy_mempools(void)
 	drbd_md_io_page_pool = NULL;
 	drbd_ee_mempool      = NULL;
 	drbd_request_mempool = NULL;
+	drbd_small_request_mempool = NULL;
 	drbd_ee_cache        = NULL;
 	drbd_request_cache   = NULL;
+	drbd_small_request_cache = NULL;
 	drbd_bm_ext_cache    = NULL;
 	drbd_al_ext_cache    = NULL;
 
@@ -2566,24 +2631,33 @@ static int drbd_create_mempools(void)
 {
 	struct page *page;
 	const int number = (DRBD_MAX_BIO_SIZE/PAGE_SIZE) * minor_count;
-	int i;
+	int i, nid;
 
 	/* prepare our caches and mempools */
 	drbd_request_mempool = NULL;
+	drbd_small_request_mempool = NULL;
 	drbd_ee_cache        = NULL;
 	drbd_request_cache   = NULL;
+	drbd_small_request_cache = NULL;
 	drbd_bm_ext_cache    = NULL;
 	drbd_al_ext_cache    = NULL;
-	drbd_pp_pool         = NULL;
+	drbd_pp_pools        = NULL;
 	drbd_md_io_page_pool = NULL;
 	drbd_md_io_bio_set   = NULL;
 
 	/* caches */
 	drbd_request_cache = kmem_cache_create(
-		"drbd_req", sizeof(struct drbd_request), 0, 0, NULL);
+		"drbd_req", sizeof(struct drbd_request) +
+		DRBD_NODE_ID_MAX * sizeof(struct drbd_request_net_jif), 0, 0, NULL);
 	if (drbd_request_cache == NULL)
 		goto Enomem;
 
+	drbd_small_request_cache = kmem_cache_create(
+		"drbd_req_small", sizeof(struct drbd_request) +
+		DRBD_SMALL_REQ_NET_JIF * sizeof(struct drbd_request_net_jif), 0, 0, NULL);
+	if (drbd_small_request_cache == NULL)
+		goto Enomem;
+
 	drbd_ee_cache = kmem_cache_create(
 		"drbd_ee", sizeof(struct drbd_peer_request), 0, 0, NULL);
 	if (drbd_ee_cache == NULL)
@@ -2595,7 +2669,7 @@ static int drbd_create_mempools(void)
 		goto Enomem;
 
 	drbd_al_ext_cache = kmem_cache_create(
-		"drbd_al", sizeof(struct lc_element), 0, 0, NULL);
+		"drbd_al", sizeof(struct al_extent), 0, 0, NULL);
 	if (drbd_al_ext_cache == NULL)
 		goto Enomem;
 
@@ -2612,21 +2686,37 @@ static int drbd_create_mempools(void)
 	if (drbd_request_mempool == NULL)
 		goto Enomem;
 
+	drbd_small_request_mempool = mempool_create_slab_pool(number, drbd_small_request_cache);
+	if (drbd_small_request_mempool == NULL)
+		goto Enomem;
+
 	drbd_ee_mempool = mempool_create_slab_pool(number, drbd_ee_cache);
 	if (drbd_ee_mempool == NULL)
 		goto Enomem;
 
-	/* drbd's page pool */
-	spin_lock_init(&drbd_pp_lock);
+	/* drbd's page pool, spread over the nodes that have memory */
+	drbd_pp_pools = kcalloc(nr_node_ids, sizeof(struct drbd_page_pool), GFP_KERNEL);
+	if (drbd_pp_pools == NULL)
+		goto Enomem;
+	drbd_pp_pool_size = DIV_ROUND_UP(number, num_node_state(N_HIGH_MEMORY));
+
+	for (nid = 0; nid < nr_node_ids; nid++) {
+		struct drbd_page_pool *pool = &drbd_pp_pools[nid];
 
-	for (i = 0; i < number; i++) {
-		page = alloc_page(GFP_HIGHUSER);
-		if (!page)
-			goto Enomem;
-		set_page_private(page, (unsigned long)drbd_pp_pool);
-		drbd_pp_pool = page;
+		spin_lock_init(&pool->lock);
+		if (!node_state(nid, N_HIGH_MEMORY))
+			continue;
+		for (i = 0; i < drbd_pp_pool_size; i++) {
+			page = alloc_pages_node(nid, GFP_HIGHUSER | __GFP_THISNODE | __GFP_NOWARN, 0);
+			/* A node short on memory just starts with a smaller
+			 * pool; drbd_alloc_pages() falls back to alloc_page(). */
+			if (!page)
+				break;
+			set_page_private(page, (unsigned long)pool->pages);
+			pool->pages = page;
+			pool->vacant++;
+		}
 	}
-	drbd_pp_vacant = number;
 
 	return 0;
 
@@ -2662,6 +2752,7 @@ static void free_peer_device(struct drbd_peer_device *peer_device)
 	lc_destroy(peer_device->resync_lru);
 	kfree(peer_device->rs_plan_s);
 	kfree(peer_device->conf);
+	free_percpu(peer_device->lat);
 	kfree(peer_device);
 }
 
@@ -2671,6 +2762,7 @@ void drbd_destroy_device(struct kref *kref)
 	struct drbd_device *device = container_of(kref, struct drbd_device, kref);
 	struct drbd_resource *resource = device->resource;
 	struct drbd_peer_device *peer_device, *tmp;
+	int i;
 
 	/* cleanup stuff that may have been allocated during
 	 * device (re-)configuration or state changes */
@@ -2694,9 +2786,19 @@ void drbd_destroy_device(struct kref *kref)
 		drbd_bm_free(device->bitmap);
 		device->bitmap = NULL;
 	}
-	__free_page(device->md_io.page);
+	for (i = 0; i < DRBD_MD_IO_BUFFERS; i++)
+		__free_page(device->md_io[i].page);
+	free_cpumask_var(device->submit.pending_cpus);
+	free_percpu(device->submit.queues);
+	free_percpu(device->lat);
+	drbd_read_cache_free(device);
+	drbd_filter_free(&device->write_filter);
+	kfree(device->al_reuse.ghost);
 	put_disk(device->vdisk);
 	blk_cleanup_queue(device->rq_queue);
+#ifdef COMPAT_HAVE_BLK_MQ
+	drbd_mq_free_queue(device);
+#endif
 	kref_debug_destroy(&device->kref_debug);
 
 	kfree(device);
@@ -2737,7 +2839,7 @@ void drbd_free_resource(struct drbd_resource *resource)
 		kref_put(&resource->twopc_parent->kref,
 			 drbd_destroy_connection);
 	}
-	mempool_free(resource->peer_ack_req, drbd_request_mempool);
+	drbd_req_free(resource->peer_ack_req);
 	del_timer_sync(&resource->twopc_timer);
 	del_timer_sync(&resource->peer_ack_timer);
 	kref_debug_put(&resource->kref_debug, 8);
@@ -3014,13 +3116,13 @@ static int drbd_alloc_send_buffers(struct drbd_connection *connection)
 
 void drbd_flush_peer_acks(struct drbd_resource *resource)
 {
-	spin_lock_irq(&resource->req_lock);
+	spin_lock_irq(&resource->peer_ack_lock);
 	if (resource->peer_ack_req) {
 		resource->last_peer_acked_dagtag = resource->peer_ack_req->dagtag_sector;
 		drbd_queue_peer_ack(resource, resource->peer_ack_req);
 		resource->peer_ack_req = NULL;
 	}
-	spin_unlock_irq(&resource->req_lock);
+	spin_unlock_irq(&resource->peer_ack_lock);
 }
 
 static void peer_ack_timer_fn(unsigned long data)
@@ -3049,9 +3151,26 @@ void conn_free_crypto(struct drbd_connection *connection)
 	connection->int_dig_vv = NULL;
 }
 
-int set_resource_options(struct drbd_resource *resource, struct res_opts *res_opts)
+static void drbd_set_cpu_mask(struct drbd_resource *resource, cpumask_var_t new_cpu_mask)
 {
 	struct drbd_connection *connection;
+
+	if (cpumask_equal(resource->cpu_mask, new_cpu_mask))
+		return;
+
+	cpumask_copy(resource->cpu_mask, new_cpu_mask);
+	resource->worker.reset_cpu_mask = 1;
+	rcu_read_lock();
+	for_each_connection_rcu(connection, resource) {
+		connection->receiver.reset_cpu_mask = 1;
+		connection->ack_receiver.reset_cpu_mask = 1;
+		connection->sender.reset_cpu_mask = 1;
+	}
+	rcu_read_unlock();
+}
+
+int set_resource_options(struct drbd_resource *resource, struct res_opts *res_opts)
+{
 	cpumask_var_t new_cpu_mask;
 	int err;
 
@@ -3084,17 +3203,8 @@ int set_resource_options(struct drbd_resource *resource, struct res_opts *res_op
 	}
 	resource->res_opts = *res_opts;
 	if (cpumask_empty(new_cpu_mask))
-		drbd_calc_cpu_mask(&new_cpu_mask);
-	if (!cpumask_equal(resource->cpu_mask, new_cpu_mask)) {
-		cpumask_copy(resource->cpu_mask, new_cpu_mask);
-		rcu_read_lock();
-		for_each_connection_rcu(connection, resource) {
-			connection->receiver.reset_cpu_mask = 1;
-			connection->ack_receiver.reset_cpu_mask = 1;
-			connection->sender.reset_cpu_mask = 1;
-		}
-		rcu_read_unlock();
-	}
+		drbd_calc_cpu_mask(&new_cpu_mask, resource->numa_node);
+	drbd_set_cpu_mask(resource, new_cpu_mask);
 	err = 0;
 
 fail:
@@ -3103,6 +3213,34 @@ fail:
 
 }
 
+/**
+ * drbd_resource_set_numa_node() - Move the threads of a resource to a NUMA node
+ * @resource:	DRBD resource.
+ * @node:	NUMA node of a newly attached backing device.
+ *
+ * Unless the user configured a cpu-mask, the threads of the resource are
+ * placed on the least used CPU of @node; peer requests and their pages are
+ * then allocated on the node of the backing device they get submitted to.
+ */
+void drbd_resource_set_numa_node(struct drbd_resource *resource, int node)
+{
+	cpumask_var_t new_cpu_mask;
+
+	if (resource->numa_node == node)
+		return;
+	resource->numa_node = node;
+
+	if (resource->res_opts.cpu_mask[0] != 0)
+		return;
+
+	if (!zalloc_cpumask_var(&new_cpu_mask, GFP_KERNEL))
+		return;
+	drbd_calc_cpu_mask(&new_cpu_mask, node);
+	if (!cpumask_empty(new_cpu_mask))
+		drbd_set_cpu_mask(resource, new_cpu_mask);
+	free_cpumask_var(new_cpu_mask);
+}
+
 struct drbd_resource *drbd_create_resource(const char *name,
 					   struct res_opts *res_opts)
 {
@@ -3125,6 +3263,10 @@ struct drbd_resource *drbd_create_resource(const char *name,
 	setup_timer(&resource->peer_ack_timer, peer_ack_timer_fn, (unsigned long) resource);
 	sema_init(&resource->state_sem, 1);
 	resource->role[NOW] = R_SECONDARY;
+	resource->numa_node = NUMA_NO_NODE;
+	spin_lock_init(&resource->al_group.lock);
+	INIT_LIST_HEAD(&resource->al_group.queued);
+	init_waitqueue_head(&resource->al_group.wait);
 	if (set_resource_options(resource, res_opts))
 		goto fail_free_name;
 	resource->max_node_id = res_opts->node_id;
@@ -3132,6 +3274,7 @@ struct drbd_resource *drbd_create_resource(const char *name,
 	mutex_init(&resource->conf_update);
 	mutex_init(&resource->adm_mutex);
 	spin_lock_init(&resource->req_lock);
+	spin_lock_init(&resource->peer_ack_lock);
 	INIT_LIST_HEAD(&resource->listeners);
 	spin_lock_init(&resource->listeners_lock);
 	init_waitqueue_head(&resource->state_wait);
@@ -3306,6 +3449,12 @@ struct drbd_peer_device *create_peer_device(struct drbd_device *device, struct d
 		return NULL;
 	}
 
+	peer_device->lat = alloc_percpu(struct drbd_peer_device_lat);
+	if (!peer_device->lat) {
+		free_peer_device(peer_device);
+		return NULL;
+	}
+
 	init_timer(&peer_device->start_resync_timer);
 	peer_device->start_resync_timer.function = start_resync_timer_fn;
 	peer_device->start_resync_timer.data = (unsigned long) peer_device;
@@ -3335,6 +3484,8 @@ struct drbd_peer_device *create_peer_device(struct drbd_device *device, struct d
 
 static int init_submitter(struct drbd_device *device)
 {
+	int cpu;
+
 	/* opencoded create_singlethread_workqueue(),
 	 * to be able to use format string arguments */
 	device->submit.wq =
@@ -3345,9 +3496,26 @@ static int init_submitter(struct drbd_device *device)
 #endif
 	if (!device->submit.wq)
 		return -ENOMEM;
+	device->submit.queues = alloc_percpu(struct submit_queue);
+	if (!device->submit.queues)
+		goto out_no_queues;
+	if (!zalloc_cpumask_var(&device->submit.pending_cpus, GFP_KERNEL))
+		goto out_no_cpumask;
+	for_each_possible_cpu(cpu) {
+		struct submit_queue *queue = per_cpu_ptr(device->submit.queues, cpu);
+
+		spin_lock_init(&queue->lock);
+		INIT_LIST_HEAD(&queue->writes);
+	}
 	INIT_WORK(&device->submit.worker, do_submit);
-	INIT_LIST_HEAD(&device->submit.writes);
 	return 0;
+
+out_no_cpumask:
+	free_percpu(device->submit.queues);
+out_no_queues:
+	destroy_workqueue(device->submit.wq);
+	device->submit.wq = NULL;
+	return -ENOMEM;
 }
 
 enum drbd_ret_code drbd_create_device(struct drbd_config_context *adm_ctx, unsigned int minor,
@@ -3361,7 +3529,7 @@ enum drbd_ret_code drbd_create_device(struct drbd_config_context *adm_ctx, unsig
 	struct request_queue *q;
 	LIST_HEAD(peer_devices);
 	LIST_HEAD(tmp);
-	int id;
+	int id, i;
 	int vnr = adm_ctx->volume;
 	enum drbd_ret_code err = ERR_NOMEM;
 	bool locked = false;
@@ -3394,8 +3562,12 @@ enum drbd_ret_code drbd_create_device(struct drbd_config_context *adm_ctx, unsig
 	atomic_set(&device->ap_bio_cnt[WRITE], 0);
 	atomic_set(&device->ap_actlog_cnt, 0);
 	atomic_set(&device->local_cnt, 0);
+	device->read_lat_node_id = -1;
 	atomic_set(&device->rs_sect_ev, 0);
-	atomic_set(&device->md_io.in_use, 0);
+	for (i = 0; i < DRBD_MD_IO_BUFFERS; i++) {
+		device->md_io[i].device = device;
+		atomic_set(&device->md_io[i].in_use, 0);
+	}
 
 	spin_lock_init(&device->al_lock);
 	mutex_init(&device->bm_resync_fo_mutex);
@@ -3423,9 +3595,19 @@ enum drbd_ret_code drbd_create_device(struct drbd_config_context *adm_ctx, unsig
 	init_waitqueue_head(&device->misc_wait);
 	init_waitqueue_head(&device->ee_wait);
 	init_waitqueue_head(&device->al_wait);
+	INIT_LIST_HEAD(&device->al_group_list);
 	init_waitqueue_head(&device->seq_wait);
 
-	q = blk_alloc_queue(GFP_KERNEL);
+#ifdef COMPAT_HAVE_BLK_MQ
+	if (use_blk_mq)
+		q = drbd_mq_alloc_queue(device);
+	else
+#endif
+	{
+		q = blk_alloc_queue(GFP_KERNEL);
+		if (q)
+			blk_queue_make_request(q, drbd_make_request);
+	}
 	if (!q)
 		goto out_no_q;
 	device->rq_queue = q;
@@ -3452,27 +3634,34 @@ enum drbd_ret_code drbd_create_device(struct drbd_config_context *adm_ctx, unsig
 	q->backing_dev_info.congested_fn = drbd_congested;
 	q->backing_dev_info.congested_data = device;
 
-	blk_queue_make_request(q, drbd_make_request);
 #ifdef REQ_FLUSH
 	blk_queue_flush(q, REQ_FLUSH | REQ_FUA);
 #endif
 	blk_queue_bounce_limit(q, BLK_BOUNCE_ANY);
 	blk_queue_merge_bvec(q, drbd_merge_bvec);
+#ifdef COMPAT_HAVE_BLK_MQ
+	if (!q->mq_ops)
+#endif
 	q->queue_lock = &resource->req_lock; /* needed since we use */
 #ifdef blk_queue_plugged
 		/* plugging on a queue, that actually has no requests! */
 	q->unplug_fn = drbd_unplug_fn;
 #endif
 
-	device->md_io.page = alloc_page(GFP_KERNEL);
-	if (!device->md_io.page)
-		goto out_no_io_page;
+	for (i = 0; i < DRBD_MD_IO_BUFFERS; i++) {
+		device->md_io[i].page = alloc_page(GFP_KERNEL);
+		if (!device->md_io[i].page)
+			goto out_no_io_page;
+	}
 
 	device->bitmap = drbd_bm_alloc();
 	if (!device->bitmap)
 		goto out_no_bitmap;
+	spin_lock_init(&device->interval_lock);
 	device->read_requests = RB_ROOT;
 	device->write_requests = RB_ROOT;
+	drbd_filter_init(&device->write_filter);
+	INIT_WORK(&device->write_filter_work, drbd_write_filter_grow);
 
 	BUG_ON(!mutex_is_locked(&resource->conf_update));
 	for_each_connection(connection, resource) {
@@ -3531,6 +3720,17 @@ enum drbd_ret_code drbd_create_device(struct drbd_config_context *adm_ctx, unsig
 		goto out_remove_peer_device;
 	}
 
+	if (drbd_read_cache_alloc(device)) {
+		err = ERR_NOMEM;
+		goto out_no_read_cache;
+	}
+
+	device->lat = alloc_percpu(struct drbd_device_lat);
+	if (!device->lat) {
+		err = ERR_NOMEM;
+		goto out_no_lat;
+	}
+
 	add_disk(disk);
 
 	for_each_peer_device(peer_device, device) {
@@ -3545,6 +3745,13 @@ enum drbd_ret_code drbd_create_device(struct drbd_config_context *adm_ctx, unsig
 	*p_device = device;
 	return NO_ERROR;
 
+out_no_lat:
+	drbd_read_cache_free(device);
+out_no_read_cache:
+	free_cpumask_var(device->submit.pending_cpus);
+	free_percpu(device->submit.queues);
+	destroy_workqueue(device->submit.wq);
+	device->submit.wq = NULL;
 out_remove_peer_device:
 	list_add_rcu(&tmp, &device->peer_devices);
 	list_del_init(&device->peer_devices);
@@ -3556,7 +3763,7 @@ out_remove_peer_device:
 		kref_put(&connection->kref, drbd_destroy_connection);
 		idr_remove(&connection->peer_devices, device->vnr);
 		list_del(&peer_device->peer_devices);
-		kfree(peer_device);
+		free_peer_device(peer_device);
 	}
 
 out_idr_remove_minor:
@@ -3569,16 +3776,22 @@ out_no_minor_idr:
 out_no_peer_device:
 	list_for_each_entry_safe(peer_device, tmp_peer_device, &peer_devices, peer_devices) {
 		list_del(&peer_device->peer_devices);
-		kfree(peer_device);
+		free_peer_device(peer_device);
 	}
 
 	drbd_bm_free(device->bitmap);
 out_no_bitmap:
-	__free_page(device->md_io.page);
 out_no_io_page:
+	for (i = 0; i < DRBD_MD_IO_BUFFERS; i++) {
+		if (device->md_io[i].page)
+			__free_page(device->md_io[i].page);
+	}
 	put_disk(disk);
 out_no_disk:
 	blk_cleanup_queue(q);
+#ifdef COMPAT_HAVE_BLK_MQ
+	drbd_mq_free_queue(device);
+#endif
 out_no_q:
 	kref_put(&resource->kref, drbd_destroy_resource);
 	kfree(device);
@@ -3813,7 +4026,7 @@ void drbd_md_write(struct drbd_device *device, void *b)
 	D_ASSERT(device, drbd_md_ss(device->ldev) == device->ldev->md.md_offset);
 	sector = device->ldev->md.md_offset;
 
-	if (drbd_md_sync_page_io(device, device->ldev, sector, WRITE)) {
+	if (drbd_md_sync_page_io(device, device->ldev, DRBD_MD_IO_SB, sector, WRITE)) {
 		/* this was a try anyways ... */
 		drbd_err(device, "meta data update failed!\n");
 		drbd_chk_io_error(device, 1, DRBD_META_IO_ERROR);
@@ -3843,13 +4056,13 @@ void drbd_md_sync(struct drbd_device *device)
 	if (!get_ldev_if_state(device, D_DETACHING))
 		return;
 
-	buffer = drbd_md_get_buffer(device, __func__);
+	buffer = drbd_md_get_buffer(device, DRBD_MD_IO_SB, __func__);
 	if (!buffer)
 		goto out;
 
 	drbd_md_write(device, buffer);
 
-	drbd_md_put_buffer(device);
+	drbd_md_put_buffer(device, DRBD_MD_IO_SB);
 out:
 	put_ldev(device);
 }
@@ -4015,7 +4228,7 @@ int drbd_md_read(struct drbd_device *device, struct drbd_backing_dev *bdev)
 	if (device->disk_state[NOW] != D_DISKLESS)
 		return ERR_DISK_CONFIGURED;
 
-	buffer = drbd_md_get_buffer(device, __func__);
+	buffer = drbd_md_get_buffer(device, DRBD_MD_IO_SB, __func__);
 	if (!buffer)
 		return ERR_NOMEM;
 
@@ -4028,7 +4241,7 @@ int drbd_md_read(struct drbd_device *device, struct drbd_backing_dev *bdev)
 	 * Affects the paranoia out-of-range access check in drbd_md_sync_page_io(). */
 	bdev->md.md_size_sect = 8;
 
-	if (drbd_md_sync_page_io(device, bdev, bdev->md.md_offset, READ)) {
+	if (drbd_md_sync_page_io(device, bdev, DRBD_MD_IO_SB, bdev->md.md_offset, READ)) {
 		/* NOTE: can't do normal error processing here as this is
 		   called BEFORE disk is attached */
 		drbd_err(device, "Error while reading metadata.\n");
@@ -4041,6 +4254,9 @@ int drbd_md_read(struct drbd_device *device, struct drbd_backing_dev *bdev)
 	if (magic == DRBD_MD_MAGIC_09 && !(flags & MDF_AL_CLEAN)) {
 			/* btw: that's Activity Log clean, not "all" clean. */
 		drbd_err(device, "Found unclean meta data. Did you \"drbdadm apply-al\"?\n");
+		if (flags & MDF_AL_COMPACT)
+			drbd_err(device, "The activity log uses the compact transaction format, "
+				 "apply-al needs a drbdmeta that knows it.\n");
 		rv = ERR_MD_UNCLEAN;
 		goto err;
 	}
@@ -4111,7 +4327,7 @@ int drbd_md_read(struct drbd_device *device, struct drbd_backing_dev *bdev)
 
 	rv = NO_ERROR;
  err:
-	drbd_md_put_buffer(device);
+	drbd_md_put_buffer(device, DRBD_MD_IO_SB);
 
 	return rv;
 }
@@ -1264,7 +1264,7 @@ drbd_determine_dev_size(struct drbd_device *device, enum dds_flags flags, struct
 	 * still lock the act_log to not trigger ASSERTs there.
 	 */
 	drbd_suspend_io(device, READ_AND_WRITE);
-	buffer = drbd_md_get_buffer(device, __func__); /* Lock meta-data IO */
+	buffer = drbd_md_get_buffer(device, DRBD_MD_IO_SB, __func__); /* Lock meta-data IO */
 	if (!buffer) {
 		drbd_resume_io(device);
 		return DS_ERROR;
@@ -1362,14 +1362,17 @@ drbd_determine_dev_size(struct drbd_device *device, enum dds_flags flags, struct
 		/* next line implicitly does drbd_suspend_io()+drbd_resume_io() */
 		drbd_bitmap_io(device, md_moved ? &drbd_bm_write_all : &drbd_bm_write,
 			       "size changed", BM_LOCK_ALL, NULL);
-		drbd_initialize_al(device, buffer);
+		drbd_initialize_al(device);
 
 		md->flags = prev_flags;
 		drbd_md_write(device, buffer);
 
-		if (rs)
+		if (rs) {
+			/* all extents inactive, and the act_log is locked */
+			device->act_log->max_pending_changes = drbd_al_max_pending_changes(device->ldev);
 			drbd_info(device, "Changed AL layout to al-stripes = %d, al-stripe-size-kB = %d\n",
 				 md->al_stripes, md->al_stripe_size_4k * 4);
+		}
 	}
 
 	if (size > la_size)
@@ -1389,7 +1392,7 @@ drbd_determine_dev_size(struct drbd_device *device, enum dds_flags flags, struct
 	}
 	lc_unlock(device->act_log);
 	wake_up(&device->al_wait);
-	drbd_md_put_buffer(device);
+	drbd_md_put_buffer(device, DRBD_MD_IO_SB);
 	drbd_resume_io(device);
 
 	return rv;
@@ -1483,31 +1486,44 @@ drbd_new_dev_size(struct drbd_device *device, sector_t u_size, int assume_peer_h
 /**
  * drbd_check_al_size() - Ensures that the AL is of the right size
  * @device:	DRBD device.
+ * @bdev:	Backing device, its AL layout and transaction format limit the pending changes.
  *
  * Returns -EBUSY if current al lru is still used, -ENOMEM when allocation
  * failed, and 0 on success. You should call drbd_md_sync() after you called
  * this function.
  */
-static int drbd_check_al_size(struct drbd_device *device, struct disk_conf *dc)
+static int drbd_check_al_size(struct drbd_device *device, struct drbd_backing_dev *bdev,
+			      struct disk_conf *dc)
 {
 	struct lru_cache *n, *t;
 	struct lc_element *e;
-	unsigned int in_use;
+	struct al_ghost *ghost = NULL;
+	unsigned int in_use, max_pending;
 	int i;
 
+	max_pending = drbd_al_max_pending_changes(bdev);
+
 	if (device->act_log &&
-	    device->act_log->nr_elements == dc->al_extents)
+	    device->act_log->nr_elements == dc->al_extents &&
+	    device->act_log->max_pending_changes == max_pending)
 		return 0;
 
 	in_use = 0;
 	t = device->act_log;
-	n = lc_create("act_log", drbd_al_ext_cache, AL_UPDATES_PER_TRANSACTION,
-		dc->al_extents, sizeof(struct lc_element), 0);
+	n = lc_create("act_log", drbd_al_ext_cache, max_pending,
+		dc->al_extents, sizeof(struct al_extent), 0);
 
 	if (n == NULL) {
 		drbd_err(device, "Cannot allocate act_log lru!\n");
 		return -ENOMEM;
 	}
+	/* working set telemetry does without, if this fails */
+	if (!device->al_reuse.ghost)
+		ghost = kmalloc(sizeof(struct al_ghost) << AL_GHOST_BITS, GFP_KERNEL);
+	if (ghost) {
+		for (i = 0; i < 1 << AL_GHOST_BITS; i++)
+			ghost[i].enr = LC_FREE;
+	}
 	spin_lock_irq(&device->al_lock);
 	if (t) {
 		for (i = 0; i < t->nr_elements; i++) {
@@ -1518,9 +1534,25 @@ static int drbd_check_al_size(struct drbd_device *device, struct disk_conf *dc)
 			in_use += e->refcnt;
 		}
 	}
-	if (!in_use)
+	if (!in_use) {
+		struct drbd_al_reuse *r = &device->al_reuse;
+
 		device->act_log = n;
+		if (ghost) {
+			r->ghost = ghost;
+			ghost = NULL;
+		}
+		if (r->ghost) {
+			for (i = 0; i < 1 << AL_GHOST_BITS; i++)
+				r->ghost[i].enr = LC_FREE;
+		}
+		memset(r->hist, 0, sizeof(r->hist));
+		r->cold = 0;
+		r->activations = 0;
+		r->recommended = 0;
+	}
 	spin_unlock_irq(&device->al_lock);
+	kfree(ghost);
 	if (in_use) {
 		drbd_err(device, "Activity log still in use!\n");
 		lc_destroy(n);
@@ -1678,23 +1710,26 @@ static unsigned int drbd_al_extents_max(struct drbd_backing_dev *bdev)
 	 *
 	 * One transaction occupies one 4kB on-disk block,
 	 * we have n such blocks in the on disk ring buffer,
-	 * the "current" transaction may fail (n-1),
-	 * and there is 919 slot numbers context information per transaction.
+	 * the "current" transactions may fail (n-1, or n-k with k
+	 * transactions per commit, see drbd_al_tr_per_commit()),
+	 * and there is 919 slot numbers context information per transaction,
+	 * or at least 567 with the compact transaction format.
 	 *
 	 * 72 transaction blocks amounts to more than 2**16 context slots,
 	 * so cap there first.
 	 */
 	const unsigned int max_al_nr = DRBD_AL_EXTENTS_MAX;
+	const unsigned int context = bdev->md.flags & MDF_AL_COMPACT ?
+		AL_COMPACT_CONTEXT_MIN : AL_CONTEXT_PER_TRANSACTION;
 	const unsigned int sufficient_on_disk =
-		(max_al_nr + AL_CONTEXT_PER_TRANSACTION -1)
-		/AL_CONTEXT_PER_TRANSACTION;
+		(max_al_nr + context - 1) / context;
 
 	unsigned int al_size_4k = bdev->md.al_size_4k;
 
 	if (al_size_4k > sufficient_on_disk)
 		return max_al_nr;
 
-	return (al_size_4k - 1) * AL_CONTEXT_PER_TRANSACTION;
+	return (al_size_4k - drbd_al_tr_per_commit(bdev)) * context;
 }
 
 static bool write_ordering_changed(struct disk_conf *a, struct disk_conf *b)
@@ -1756,7 +1791,7 @@ int drbd_adm_disk_opts(struct sk_buff *skb, struct genl_info *info)
 	drbd_suspend_io(device, READ_AND_WRITE);
 	wait_event(device->al_wait, lc_try_lock(device->act_log));
 	drbd_al_shrink(device);
-	err = drbd_check_al_size(device, new_disk_conf);
+	err = drbd_check_al_size(device, device->ldev, new_disk_conf);
 	lc_unlock(device->act_log);
 	wake_up(&device->al_wait);
 	drbd_resume_io(device);
@@ -1890,6 +1925,7 @@ int drbd_adm_attach(struct sk_buff *skb, struct genl_info *info)
 	struct drbd_peer_device *peer_device;
 	unsigned int slots_needed = 0;
 	bool have_conf_update = false;
+	bool al_format_changed, want_al_compact;
 
 	retcode = drbd_adm_prepare(&adm_ctx, skb, info, DRBD_ADM_NEED_MINOR);
 	if (!adm_ctx.reply_skb)
@@ -2008,6 +2044,21 @@ int drbd_adm_attach(struct sk_buff *skb, struct genl_info *info)
 	if (retcode != NO_ERROR)
 		goto fail;
 
+	/* The AL is clean, so the transaction format may change here.
+	 * Only use the compact format if drbdmeta has flagged the meta data
+	 * as one it can apply compact transactions for. */
+	want_al_compact = al_compact;
+	if (want_al_compact && !(nbc->md.flags & MDF_AL_COMPACT_OK)) {
+		drbd_warn(device, "drbdmeta did not enable the compact activity log format "
+			  "on this meta data, using the classic format\n");
+		want_al_compact = false;
+	}
+	al_format_changed = !(nbc->md.flags & MDF_AL_COMPACT) != !want_al_compact;
+	if (want_al_compact)
+		nbc->md.flags |= MDF_AL_COMPACT;
+	else
+		nbc->md.flags &= ~MDF_AL_COMPACT;
+
 	if (new_disk_conf->al_extents < DRBD_AL_EXTENTS_MIN)
 		new_disk_conf->al_extents = DRBD_AL_EXTENTS_MIN;
 	if (new_disk_conf->al_extents > drbd_al_extents_max(nbc))
@@ -2167,7 +2218,7 @@ int drbd_adm_attach(struct sk_buff *skb, struct genl_info *info)
 	}
 
 	/* Since we are diskless, fix the activity log first... */
-	if (drbd_check_al_size(device, new_disk_conf)) {
+	if (drbd_check_al_size(device, nbc, new_disk_conf)) {
 		retcode = ERR_NOMEM;
 		goto force_diskless_dec;
 	}
@@ -2229,6 +2280,7 @@ int drbd_adm_attach(struct sk_buff *skb, struct genl_info *info)
 	device->writ_cnt = 0;
 
 	drbd_reconsider_max_bio_size(device, device->ldev);
+	drbd_resource_set_numa_node(resource, device->ldev->backing_bdev->bd_disk->queue->node);
 
 	/* If I am currently not R_PRIMARY,
 	 * but meta data primary indicator is set,
@@ -2292,6 +2344,17 @@ int drbd_adm_attach(struct sk_buff *skb, struct genl_info *info)
 		device->ldev->md.flags |= MDF_AL_DISABLED;
 	rcu_read_unlock();
 
+	/* Do not leave transactions of the previous format in the on-disk
+	 * ring buffer. */
+	if (al_format_changed) {
+		drbd_info(device, "Switching to the %s activity log transaction format\n",
+			  device->ldev->md.flags & MDF_AL_COMPACT ? "compact" : "classic");
+		if (drbd_initialize_al(device)) {
+			retcode = ERR_IO_MD_DISK;
+			goto force_diskless_dec;
+		}
+	}
+
 	/* change_disk_state uses disk_state_from_md(device); in case D_NEGOTIATING not
 	   necessary, and falls back to a local state change */
 	rv = stable_state_change(resource,
@@ -4114,6 +4177,19 @@ static void device_to_statistics(struct device_statistics *s,
 	s->dev_lower_pending = atomic_read(&device->local_cnt);
 	s->dev_al_suspended = test_bit(AL_SUSPENDED, &device->flags);
 	s->dev_exposed_data_uuid = device->exposed_data_uuid;
+	if (get_ldev(device)) {
+		u64 *hist = (u64 *)s->dev_al_reuse_hist;
+
+		spin_lock_irq(&device->al_lock);
+		s->dev_al_active = device->act_log->active;
+		s->dev_al_recommended = device->al_reuse.recommended;
+		s->dev_al_reuse_cold = device->al_reuse.cold;
+		BUILD_BUG_ON(sizeof(s->dev_al_reuse_hist) != sizeof(device->al_reuse.hist));
+		memcpy(hist, device->al_reuse.hist, sizeof(device->al_reuse.hist));
+		s->dev_al_reuse_hist_len = sizeof(s->dev_al_reuse_hist);
+		spin_unlock_irq(&device->al_lock);
+		put_ldev(device);
+	}
 }
 
 static int put_resource_in_arg0(struct netlink_callback *cb, int holder_nr)
@@ -0,0 +1,382 @@
+/*
+ * A diskless primary has to ask a peer for every read, even for blocks it
+ * just read a moment ago.  If enabled with the read_cache_blocks module
+ * parameter, we keep the data of recent reads in a small LRU of pages,
+ * and complete reads which are fully covered by it without going to
+ * the network.
+ *
+ * We do not get told about writes by other nodes, so the cache is only
+ * used while we are the only primary, and can stay the only one: not with
+ * allow-two-primaries on any connection, and only while all configured
+ * peers are connected, so none of them can get promoted behind our back.
+ * It is dropped completely on any role or connection state change, and
+ * invalidated for the range of each of our own writes on completion of
+ * that write.
+ *
+ * Reads racing with writes: every invalidation bumps rc->seq.  A remote
+ * read remembers rc->seq when it is sent, and its data is only inserted
+ * into the cache, if no invalidation happened meanwhile.
+ */
+
+#include <linux/slab.h>
+#include <linux/highmem.h>
+#include <linux/seq_file.h>
+
+#include "drbd_int.h"
+#include "drbd_req.h"
+
+#define RC_BLOCK_SHIFT		(PAGE_SHIFT - 9)
+#define RC_SECT_PER_BLOCK	(1UL << RC_BLOCK_SHIFT)
+#define RC_HASH_SIZE		256
+/* do not bother with larger requests, they are not "hot blocks" */
+#define RC_MAX_BLOCKS		32
+
+struct rc_entry {
+	struct list_head hash;
+	struct list_head lru;
+	sector_t sector;	/* first sector of this block */
+	struct page *page;
+};
+
+struct drbd_read_cache {
+	spinlock_t lock;
+	unsigned int seq;		/* bumped by every invalidation */
+	unsigned int nr_entries;
+	unsigned int max_entries;
+	struct list_head lru;		/* most recently used first */
+	struct list_head hash[RC_HASH_SIZE];
+
+	/* statistics */
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long fills;
+	unsigned long stale_fills;	/* dropped due to racing invalidation */
+};
+
+static struct list_head *rc_hash_slot(struct drbd_read_cache *rc, sector_t sector)
+{
+	return &rc->hash[(sector >> RC_BLOCK_SHIFT) % RC_HASH_SIZE];
+}
+
+static struct rc_entry *rc_find(struct drbd_read_cache *rc, sector_t sector)
+{
+	struct rc_entry *e;
+
+	list_for_each_entry(e, rc_hash_slot(rc, sector), hash) {
+		if (e->sector == sector)
+			return e;
+	}
+	return NULL;
+}
+
+static void rc_free_entry(struct rc_entry *e)
+{
+	__free_page(e->page);
+	kfree(e);
+}
+
+static void rc_remove(struct drbd_read_cache *rc, struct rc_entry *e)
+{
+	list_del(&e->hash);
+	list_del(&e->lru);
+	rc->nr_entries--;
+	rc_free_entry(e);
+}
+
+static bool read_cache_usable(struct drbd_device *device)
+{
+	struct drbd_resource *resource = device->resource;
+	struct drbd_connection *connection;
+	bool usable = true;
+
+	if (device->disk_state[NOW] != D_DISKLESS ||
+	    resource->role[NOW] != R_PRIMARY ||
+	    drbd_suspended(device))
+		return false;
+
+	rcu_read_lock();
+	for_each_connection_rcu(connection, resource) {
+		struct net_conf *nc = rcu_dereference(connection->transport.net_conf);
+
+		if (connection->cstate[NOW] != C_CONNECTED ||
+		    connection->peer_role[NOW] == R_PRIMARY ||
+		    !nc || nc->two_primaries) {
+			usable = false;
+			break;
+		}
+	}
+	rcu_read_unlock();
+	return usable;
+}
+
+/* @base is the byte offset of the start of the bio relative to pages[0],
+ * it is negative if the bio starts before the first cached block.
+ * Copies only the part of the bio that lies within the @nr pages. */
+static void rc_copy(struct bio *bio, struct page **pages, unsigned int nr,
+		    long long base, bool to_bio)
+{
+	const long long limit = (long long)nr << PAGE_SHIFT;
+	DRBD_BIO_VEC_TYPE bvec;
+	DRBD_ITER_TYPE iter;
+	long long pos = base;
+
+	bio_for_each_segment(bvec, bio, iter) {
+		unsigned int len = bvec BVD bv_len;
+		unsigned int done = 0;
+
+		while (done < len) {
+			long long cpos = pos + done;
+			unsigned int chunk;
+			void *b, *c;
+
+			if (cpos < 0) {
+				chunk = min_t(long long, len - done, -cpos);
+				done += chunk;
+				continue;
+			}
+			if (cpos >= limit)
+				return;
+
+			chunk = min_t(unsigned int, len - done,
+				      PAGE_SIZE - (cpos & (PAGE_SIZE - 1)));
+			b = drbd_kmap_atomic(bvec BVD bv_page, KM_USER0);
+			c = drbd_kmap_atomic(pages[cpos >> PAGE_SHIFT], KM_USER1);
+			if (to_bio)
+				memcpy(b + bvec BVD bv_offset + done,
+				       c + (cpos & (PAGE_SIZE - 1)), chunk);
+			else
+				memcpy(c + (cpos & (PAGE_SIZE - 1)),
+				       b + bvec BVD bv_offset + done, chunk);
+			drbd_kunmap_atomic(c, KM_USER1);
+			drbd_kunmap_atomic(b, KM_USER0);
+			done += chunk;
+		}
+		pos += len;
+	}
+}
+
+/**
+ * drbd_read_cache_lookup() - Try to complete a read from the read cache
+ * @device:	DRBD device.
+ * @bio:	The bio as submitted by the upper layers.
+ *
+ * Returns true if @bio was completed from the cache.
+ */
+bool drbd_read_cache_lookup(struct drbd_device *device, struct bio *bio)
+{
+	struct drbd_read_cache *rc = device->read_cache;
+	struct page *pages[RC_MAX_BLOCKS];
+	sector_t sector = DRBD_BIO_BI_SECTOR(bio);
+	unsigned int size = DRBD_BIO_BI_SIZE(bio);
+	unsigned long flags;
+	unsigned int nr, i;
+	sector_t first;
+
+	if (!rc || bio_data_dir(bio) != READ || !size)
+		return false;
+	if (!read_cache_usable(device))
+		return false;
+
+	first = sector & ~((sector_t)RC_SECT_PER_BLOCK - 1);
+	nr = DIV_ROUND_UP((unsigned int)(sector - first) + (size >> 9), RC_SECT_PER_BLOCK);
+	if (nr > RC_MAX_BLOCKS)
+		return false;
+
+	spin_lock_irqsave(&rc->lock, flags);
+	for (i = 0; i < nr; i++) {
+		struct rc_entry *e = rc_find(rc, first + i * RC_SECT_PER_BLOCK);
+
+		if (!e) {
+			rc->misses++;
+			spin_unlock_irqrestore(&rc->lock, flags);
+			while (i--)
+				put_page(pages[i]);
+			return false;
+		}
+		list_move(&e->lru, &rc->lru);
+		get_page(e->page);
+		pages[i] = e->page;
+	}
+	rc->hits++;
+	spin_unlock_irqrestore(&rc->lock, flags);
+
+	rc_copy(bio, pages, nr, (long long)(sector - first) << 9, true);
+	for (i = 0; i < nr; i++)
+		put_page(pages[i]);
+
+	bio_endio(bio, 0);
+	return true;
+}
+
+/**
+ * drbd_read_cache_fill() - Insert the data of a completed remote read
+ * @device:	DRBD device.
+ * @req:	The read request, its master_bio already holds the data.
+ *
+ * Only blocks fully covered by the request are inserted.
+ */
+void drbd_read_cache_fill(struct drbd_device *device, struct drbd_request *req)
+{
+	struct drbd_read_cache *rc = device->read_cache;
+	struct rc_entry *entries[RC_MAX_BLOCKS];
+	struct page *pages[RC_MAX_BLOCKS];
+	sector_t sector = req->i.sector;
+	sector_t first, end;
+	unsigned long flags;
+	unsigned int nr, i;
+
+	if (!rc)
+		return;
+
+	first = (sector + RC_SECT_PER_BLOCK - 1) & ~((sector_t)RC_SECT_PER_BLOCK - 1);
+	end = (sector + (req->i.size >> 9)) & ~((sector_t)RC_SECT_PER_BLOCK - 1);
+	if (end <= first || !read_cache_usable(device))
+		return;
+	nr = min_t(sector_t, (end - first) >> RC_BLOCK_SHIFT, RC_MAX_BLOCKS);
+
+	for (i = 0; i < nr; i++) {
+		entries[i] = kmalloc(sizeof(struct rc_entry), GFP_NOIO | __GFP_NOWARN);
+		pages[i] = alloc_page(GFP_NOIO | __GFP_NOWARN);
+		if (!entries[i] || !pages[i]) {
+			kfree(entries[i]);
+			if (pages[i])
+				__free_page(pages[i]);
+			nr = i;
+			break;
+		}
+		entries[i]->sector = first + i * RC_SECT_PER_BLOCK;
+		entries[i]->page = pages[i];
+	}
+	if (!nr)
+		return;
+
+	rc_copy(req->master_bio, pages, nr, -((long long)(first - sector) << 9), false);
+
+	spin_lock_irqsave(&rc->lock, flags);
+	if (rc->seq != req->read_cache_seq) {
+		rc->stale_fills++;
+		i = 0;
+		goto out_unlock;
+	}
+	for (i = 0; i < nr; i++) {
+		struct rc_entry *e = rc_find(rc, entries[i]->sector);
+
+		if (e) {
+			/* same data, keep the one we have */
+			list_move(&e->lru, &rc->lru);
+			rc_free_entry(entries[i]);
+			continue;
+		}
+		list_add(&entries[i]->hash, rc_hash_slot(rc, entries[i]->sector));
+		list_add(&entries[i]->lru, &rc->lru);
+		rc->nr_entries++;
+	}
+	rc->fills++;
+	while (rc->nr_entries > rc->max_entries)
+		rc_remove(rc, list_last_entry(&rc->lru, struct rc_entry, lru));
+out_unlock:
+	spin_unlock_irqrestore(&rc->lock, flags);
+
+	/* not inserted */
+	for (; i < nr; i++)
+		rc_free_entry(entries[i]);
+}
+
+/* called with the req_lock held, when a remote read is sent */
+unsigned int drbd_read_cache_seq(struct drbd_device *device)
+{
+	return device->read_cache ? device->read_cache->seq : 0;
+}
+
+/**
+ * drbd_read_cache_invalidate() - Drop cached blocks overlapping a range
+ * @device:	DRBD device.
+ * @sector:	Start sector of the range.
+ * @size:	Size of the range in bytes.
+ */
+void drbd_read_cache_invalidate(struct drbd_device *device, sector_t sector, unsigned int size)
+{
+	struct drbd_read_cache *rc = device->read_cache;
+	struct rc_entry *e, *tmp;
+	unsigned long flags, nr, i;
+	sector_t first;
+
+	if (!rc)
+		return;
+
+	first = sector & ~((sector_t)RC_SECT_PER_BLOCK - 1);
+	nr = DIV_ROUND_UP((unsigned long)(sector - first) + (size >> 9), RC_SECT_PER_BLOCK);
+
+	spin_lock_irqsave(&rc->lock, flags);
+	rc->seq++;
+	if (nr > rc->nr_entries) {
+		/* e.g. a large discard: cheaper to look at what we have */
+		list_for_each_entry_safe(e, tmp, &rc->lru, lru) {
+			if (e->sector >= first && e->sector < first + nr * RC_SECT_PER_BLOCK)
+				rc_remove(rc, e);
+		}
+	} else {
+		for (i = 0; i < nr; i++) {
+			e = rc_find(rc, first + i * RC_SECT_PER_BLOCK);
+			if (e)
+				rc_remove(rc, e);
+		}
+	}
+	spin_unlock_irqrestore(&rc->lock, flags);
+}
+
+void drbd_read_cache_clear(struct drbd_device *device)
+{
+	struct drbd_read_cache *rc = device->read_cache;
+	struct rc_entry *e, *tmp;
+	unsigned long flags;
+
+	if (!rc)
+		return;
+
+	spin_lock_irqsave(&rc->lock, flags);
+	rc->seq++;
+	list_for_each_entry_safe(e, tmp, &rc->lru, lru)
+		rc_remove(rc, e);
+	spin_unlock_irqrestore(&rc->lock, flags);
+}
+
+int drbd_read_cache_alloc(struct drbd_device *device)
+{
+	struct drbd_read_cache *rc;
+	int i;
+
+	if (!read_cache_blocks)
+		return 0;
+
+	rc = kzalloc(sizeof(*rc), GFP_KERNEL);
+	if (!rc)
+		return -ENOMEM;
+	spin_lock_init(&rc->lock);
+	INIT_LIST_HEAD(&rc->lru);
+	for (i = 0; i < RC_HASH_SIZE; i++)
+		INIT_LIST_HEAD(&rc->hash[i]);
+	rc->max_entries = read_cache_blocks;
+	device->read_cache = rc;
+	return 0;
+}
+
+void drbd_read_cache_free(struct drbd_device *device)
+{
+	drbd_read_cache_clear(device);
+	kfree(device->read_cache);
+	device->read_cache = NULL;
+}
+
+void drbd_read_cache_seq_printf_stats(struct seq_file *seq, struct drbd_device *device)
+{
+	struct drbd_read_cache *rc = device->read_cache;
+
+	if (!rc) {
+		seq_puts(seq, "disabled\n");
+		return;
+	}
+	seq_printf(seq, "entries: %u/%u hits: %lu misses: %lu fills: %lu stale_fills: %lu\n",
+		   rc->nr_entries, rc->max_entries,
+		   rc->hits, rc->misses, rc->fills, rc->stale_fills);
+}
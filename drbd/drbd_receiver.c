@@ -163,20 +163,70 @@ static void page_chain_add(struct page **head,
 	*head = chain_first;
 }
 
+/* Gives each page of a chain back to the pool of the node it lives on,
+ * or to the system if that pool is full.  Consecutive pages of the same
+ * node go back in one go.  Returns the number of pages. */
+static int page_chain_free_to_pools(struct page *page)
+{
+	int count = 0;
+
+	while (page) {
+		struct drbd_page_pool *pool = &drbd_pp_pools[page_to_nid(page)];
+		struct page *first = page, *last = page, *tmp;
+		int i = 1;
+
+		while ((tmp = page_chain_next(last)) && page_to_nid(tmp) == page_to_nid(first))
+			++i, last = tmp;
+		page = tmp;
+		set_page_private(last, 0);
+		count += i;
+
+		if (pool->vacant > drbd_pp_pool_size)
+			page_chain_free(first);
+		else {
+			spin_lock(&pool->lock);
+			page_chain_add(&pool->pages, first, last);
+			pool->vacant += i;
+			spin_unlock(&pool->lock);
+		}
+	}
+	return count;
+}
+
+static struct page *pp_pool_del(struct drbd_page_pool *pool, unsigned int number)
+{
+	struct page *page = NULL;
+
+	/* Yes, testing pool->vacant outside the lock is racy.
+	 * So what. It saves a spin_lock. */
+	if (pool->vacant >= number) {
+		spin_lock(&pool->lock);
+		page = page_chain_del(&pool->pages, number);
+		if (page)
+			pool->vacant -= number;
+		spin_unlock(&pool->lock);
+	}
+	return page;
+}
+
 static struct page *__drbd_alloc_pages(unsigned int number, gfp_t gfp_mask)
 {
+	int local_nid = numa_node_id(), nid;
 	struct page *page = NULL;
 	struct page *tmp = NULL;
 	unsigned int i = 0;
 
-	/* Yes, testing drbd_pp_vacant outside the lock is racy.
-	 * So what. It saves a spin_lock. */
-	if (drbd_pp_vacant >= number) {
-		spin_lock(&drbd_pp_lock);
-		page = page_chain_del(&drbd_pp_pool, number);
-		if (page)
-			drbd_pp_vacant -= number;
-		spin_unlock(&drbd_pp_lock);
+	page = pp_pool_del(&drbd_pp_pools[local_nid], number);
+	if (page)
+		return page;
+
+	/* Pages go back to the pool of their own node, so one node's pool
+	 * may run dry while others are full.  Use those before depending
+	 * on the page allocator, for guaranteed forward progress. */
+	for_each_node_state(nid, N_HIGH_MEMORY) {
+		if (nid == local_nid)
+			continue;
+		page = pp_pool_del(&drbd_pp_pools[nid], number);
 		if (page)
 			return page;
 	}
@@ -195,13 +245,8 @@ static struct page *__drbd_alloc_pages(unsigned int number, gfp_t gfp_mask)
 	/* Not enough pages immediately available this time.
 	 * No need to jump around here, drbd_alloc_pages will retry this
 	 * function "soon". */
-	if (page) {
-		tmp = page_chain_tail(page, NULL);
-		spin_lock(&drbd_pp_lock);
-		page_chain_add(&drbd_pp_pool, page, tmp);
-		drbd_pp_vacant += i;
-		spin_unlock(&drbd_pp_lock);
-	}
+	if (page)
+		page_chain_free_to_pools(page);
 	return NULL;
 }
 
@@ -349,16 +394,7 @@ void drbd_free_pages(struct drbd_transport *transport, struct page *page, int is
 	if (page == NULL)
 		return;
 
-	if (drbd_pp_vacant > (DRBD_MAX_BIO_SIZE/PAGE_SIZE) * minor_count)
-		i = page_chain_free(page);
-	else {
-		struct page *tmp;
-		tmp = page_chain_tail(page, &i);
-		spin_lock(&drbd_pp_lock);
-		page_chain_add(&drbd_pp_pool, page, tmp);
-		drbd_pp_vacant += i;
-		spin_unlock(&drbd_pp_lock);
-	}
+	i = page_chain_free_to_pools(page);
 	i = atomic_sub_return(i, a);
 	if (i < 0)
 		drbd_warn(connection, "ASSERTION FAILED: %s: %d < 0\n",
@@ -1230,8 +1266,11 @@ static void drbd_remove_peer_req_interval(struct drbd_device *device,
 {
 	struct drbd_interval *i = &peer_req->i;
 
-	drbd_remove_interval(&device->write_requests, i);
-	drbd_clear_interval(i);
+	/* Not inserted if we failed before handle_write_conflicts() */
+	if (!drbd_interval_empty(i)) {
+		drbd_remove_write_interval(device, i);
+		drbd_clear_interval(i);
+	}
 
 	/* Wake up any processes waiting for this peer request to complete.  */
 	if (i->waiting)
@@ -1695,9 +1734,9 @@ static int receive_DataReply(struct drbd_connection *connection, struct packet_i
 
 	sector = be64_to_cpu(p->sector);
 
-	spin_lock_irq(&device->resource->req_lock);
+	spin_lock_irq(&device->interval_lock);
 	req = find_request(device, &device->read_requests, p->block_id, sector, false, __func__);
-	spin_unlock_irq(&device->resource->req_lock);
+	spin_unlock_irq(&device->interval_lock);
 	if (unlikely(!req))
 		return -EIO;
 
@@ -1705,8 +1744,10 @@ static int receive_DataReply(struct drbd_connection *connection, struct packet_i
 	 * special casing it there for the various failure cases.
 	 * still no race with drbd_fail_pending_reads */
 	err = recv_dless_read(peer_device, req, sector, pi->size);
-	if (!err)
+	if (!err) {
+		drbd_read_cache_fill(device, req);
 		req_mod(req, DATA_RECEIVED, peer_device);
+	}
 	/* else: nothing. handled from drbd_disconnect...
 	 * I don't think we may complete this just yet
 	 * in case we are "on-disconnect: freeze" */
@@ -1756,6 +1797,8 @@ static void restart_conflicting_writes(struct drbd_peer_request *peer_req)
 	const sector_t sector = peer_req->i.sector;
 	const unsigned int size = peer_req->i.size;
 
+	if (!drbd_filter_may_overlap(&device->write_filter, sector, size))
+		return;
 	drbd_for_each_overlap(i, &device->write_requests, sector, size) {
 		if (!i->local)
 			continue;
@@ -1997,6 +2040,8 @@ static void fail_postponed_requests(struct drbd_peer_request *peer_req)
 	const sector_t sector = peer_req->i.sector;
 	const unsigned int size = peer_req->i.size;
 
+	if (!drbd_filter_may_overlap(&device->write_filter, sector, size))
+		return;
     repeat:
 	drbd_for_each_overlap(i, &device->write_requests, sector, size) {
 		struct drbd_request *req;
@@ -2026,14 +2071,19 @@ static int handle_write_conflicts(struct drbd_peer_request *peer_req)
 	sector_t sector = peer_req->i.sector;
 	const unsigned int size = peer_req->i.size;
 	struct drbd_interval *i;
+	bool may_conflict;
 	bool equal;
 	int err;
 
+	may_conflict = drbd_filter_may_overlap(&device->write_filter, sector, size);
+
 	/*
 	 * Inserting the peer request into the write_requests tree will prevent
 	 * new conflicting local requests from being added.
 	 */
-	drbd_insert_interval(&device->write_requests, &peer_req->i);
+	drbd_insert_write_interval(device, &peer_req->i);
+	if (!may_conflict)
+		return 0;
 
     repeat:
 	drbd_for_each_overlap(i, &device->write_requests, sector, size) {
@@ -6454,7 +6504,7 @@ void req_destroy_after_send_peer_ack(struct kref *kref)
 {
 	struct drbd_request *req = container_of(kref, struct drbd_request, kref);
 	list_del(&req->tl_requests);
-	mempool_free(req, drbd_request_mempool);
+	drbd_req_free(req);
 }
 
 static int process_peer_ack_list(struct drbd_connection *connection)
@@ -6466,7 +6516,7 @@ static int process_peer_ack_list(struct drbd_connection *connection)
 
 	idx = 1 + connection->peer_node_id;
 
-	spin_lock_irq(&resource->req_lock);
+	spin_lock_irq(&resource->peer_ack_lock);
 	req = list_first_entry(&resource->peer_ack_list, struct drbd_request, tl_requests);
 	while (&req->tl_requests != &resource->peer_ack_list) {
 		if (!(req->rq_state[idx] & RQ_PEER_ACK)) {
@@ -6474,18 +6524,18 @@ static int process_peer_ack_list(struct drbd_connection *connection)
 			continue;
 		}
 		req->rq_state[idx] &= ~RQ_PEER_ACK;
-		spin_unlock_irq(&resource->req_lock);
+		spin_unlock_irq(&resource->peer_ack_lock);
 
 		err = drbd_send_peer_ack(connection, req);
 
-		spin_lock_irq(&resource->req_lock);
+		spin_lock_irq(&resource->peer_ack_lock);
 		tmp = list_next_entry(req, tl_requests);
 		kref_put(&req->kref, req_destroy_after_send_peer_ack);
 		if (err)
 			break;
 		req = tmp;
 	}
-	spin_unlock_irq(&resource->req_lock);
+	spin_unlock_irq(&resource->peer_ack_lock);
 	return err;
 }
 
@@ -7014,7 +7064,7 @@ static void destroy_request(struct kref *kref)
 		container_of(kref, struct drbd_request, kref);
 
 	list_del(&req->tl_requests);
-	mempool_free(req, drbd_request_mempool);
+	drbd_req_free(req);
 }
 
 static void cleanup_peer_ack_list(struct drbd_connection *connection)
@@ -7023,7 +7073,7 @@ static void cleanup_peer_ack_list(struct drbd_connection *connection)
 	struct drbd_request *req, *tmp;
 	int idx;
 
-	spin_lock_irq(&resource->req_lock);
+	spin_lock_irq(&resource->peer_ack_lock);
 	idx = 1 + connection->peer_node_id;
 	list_for_each_entry_safe(req, tmp, &resource->peer_ack_list, tl_requests) {
 		if (!(req->rq_state[idx] & RQ_PEER_ACK))
@@ -7031,7 +7081,7 @@ static void cleanup_peer_ack_list(struct drbd_connection *connection)
 		req->rq_state[idx] &= ~RQ_PEER_ACK;
 		kref_put(&req->kref, destroy_request);
 	}
-	spin_unlock_irq(&resource->req_lock);
+	spin_unlock_irq(&resource->peer_ack_lock);
 }
 
 struct meta_sock_cmd {
@@ -81,19 +81,22 @@ static void _drbd_end_io_acct(struct drbd_device *device, struct drbd_request *r
 {
 	int rw = bio_data_dir(req->master_bio);
 	unsigned long duration = jiffies - req->start_jif;
+	/* requests coalesced into this one complete with it */
+	unsigned int nr = 1 + req->coalesced;
 #ifndef __disk_stat_inc
 	int cpu;
 #endif
 
 #ifdef __disk_stat_add
-	__disk_stat_add(device->vdisk, ticks[rw], duration);
+	__disk_stat_add(device->vdisk, ticks[rw], duration * nr);
 	disk_round_stats(device->vdisk);
-	device->vdisk->in_flight--;
+	device->vdisk->in_flight -= nr;
 #else
 	cpu = part_stat_lock();
-	part_stat_add(cpu, &device->vdisk->part0, ticks[rw], duration);
+	part_stat_add(cpu, &device->vdisk->part0, ticks[rw], duration * nr);
 	part_round_stats(cpu, &device->vdisk->part0);
-	part_dec_in_flight(&device->vdisk->part0, rw);
+	while (nr--)
+		part_dec_in_flight(&device->vdisk->part0, rw);
 	part_stat_unlock();
 #endif
 }
@@ -104,13 +107,24 @@ static struct drbd_request *drbd_req_new(struct drbd_device *device,
 					       struct bio *bio_src)
 {
 	struct drbd_request *req;
+	unsigned int nr_net_jif;
+	mempool_t *pool;
 	int i;
 
-	req = mempool_alloc(drbd_request_mempool, GFP_NOIO);
+	if (device->resource->max_node_id < DRBD_SMALL_REQ_NET_JIF) {
+		nr_net_jif = DRBD_SMALL_REQ_NET_JIF;
+		pool = drbd_small_request_mempool;
+	} else {
+		nr_net_jif = DRBD_NODE_ID_MAX;
+		pool = drbd_request_mempool;
+	}
+
+	req = mempool_alloc(pool, GFP_NOIO);
 	if (!req)
 		return NULL;
 
-	memset(req, 0, sizeof(*req));
+	memset(req, 0, sizeof(*req) + nr_net_jif * sizeof(req->net_jif[0]));
+	req->nr_net_jif = nr_net_jif;
 
 	drbd_req_make_private_bio(req, bio_src);
 
@@ -144,11 +158,24 @@ static struct drbd_request *drbd_req_new(struct drbd_device *device,
 	return req;
 }
 
+void drbd_req_free(struct drbd_request *req)
+{
+	if (!req)
+		return;
+	if (req->nr_net_jif > DRBD_SMALL_REQ_NET_JIF)
+		mempool_free(req, drbd_request_mempool);
+	else
+		mempool_free(req, drbd_small_request_mempool);
+}
+
+/* called with resource->peer_ack_lock held */
 void drbd_queue_peer_ack(struct drbd_resource *resource, struct drbd_request *req)
 {
 	struct drbd_connection *connection;
 	bool queued = false;
 
+	lockdep_assert_held(&resource->peer_ack_lock);
+
 	rcu_read_lock();
 	for_each_connection_rcu(connection, resource) {
 		unsigned int node_id = connection->peer_node_id;
@@ -167,7 +194,7 @@ void drbd_queue_peer_ack(struct drbd_resource *resource, struct drbd_request *re
 	rcu_read_unlock();
 
 	if (!queued)
-		mempool_free(req, drbd_request_mempool);
+		drbd_req_free(req);
 }
 
 static bool peer_ack_differs(struct drbd_request *req1, struct drbd_request *req2)
@@ -197,7 +224,13 @@ static void drbd_remove_request_interval(struct rb_root *root,
 	struct drbd_device *device = req->device;
 	struct drbd_interval *i = &req->i;
 
-	drbd_remove_interval(root, i);
+	if (root == &device->write_requests) {
+		drbd_remove_write_interval(device, i);
+	} else {
+		spin_lock(&device->interval_lock);
+		drbd_remove_interval(root, i);
+		spin_unlock(&device->interval_lock);
+	}
 
 	/* Wake up any processes waiting for this request to complete.  */
 	if (i->waiting)
@@ -311,15 +344,18 @@ tail_recursion:
 	device_refs++; /* In both branches of the if the reference to device gets released */
 	if (s & RQ_WRITE && req->i.size) {
 		struct drbd_resource *resource = device->resource;
-		struct drbd_request *peer_ack_req = resource->peer_ack_req;
+		struct drbd_request *peer_ack_req;
 
+		/* we hold the req_lock, irqs are already disabled */
+		spin_lock(&resource->peer_ack_lock);
+		peer_ack_req = resource->peer_ack_req;
 		if (peer_ack_req) {
 			if (peer_ack_differs(req, peer_ack_req) ||
 			    peer_ack_window_full(req)) {
 				drbd_queue_peer_ack(resource, peer_ack_req);
 				peer_ack_req = NULL;
 			} else
-				mempool_free(peer_ack_req, drbd_request_mempool);
+				drbd_req_free(peer_ack_req);
 		}
 		req->device = NULL;
 		resource->peer_ack_req = req;
@@ -328,8 +364,9 @@ tail_recursion:
 
 		if (!peer_ack_req)
 			resource->last_peer_acked_dagtag = req->dagtag_sector;
+		spin_unlock(&resource->peer_ack_lock);
 	} else
-		mempool_free(req, drbd_request_mempool);
+		drbd_req_free(req);
 
 	if (s & RQ_WRITE && req_size) {
 		list_for_each_entry(req, &device->resource->transfer_log, tl_requests) {
@@ -459,6 +496,13 @@ void drbd_req_complete(struct drbd_request *req, struct bio_and_error *m)
 
 	rw = bio_rw(req->master_bio);
 
+	drbd_lat_account(&device->lat->stage[LAT_TOTAL], req->start_kt);
+
+	/* Cached data for this range is outdated, whether or not
+	 * the write was successful. */
+	if (rw == WRITE && req->i.size)
+		drbd_read_cache_invalidate(device, req->i.sector, req->i.size);
+
 	/* Before we can signal completion to the upper layers,
 	 * we may need to close the current transfer log epoch.
 	 * We are within the request lock, so we can simply compare
@@ -615,6 +659,7 @@ static void mod_rq_state(struct drbd_request *req, struct bio_and_error *m,
 		struct drbd_peer_device *peer_device,
 		int clear, int set)
 {
+	struct drbd_request_net_jif *net_jif;
 	unsigned old_net;
 	unsigned old_local = req->rq_state[0];
 	unsigned set_local = set & RQ_STATE_0_MASK;
@@ -704,13 +749,20 @@ static void mod_rq_state(struct drbd_request *req, struct bio_and_error *m,
 			++k_put;
 		else
 			++c_put;
+		drbd_lat_account(&req->device->lat->stage[LAT_LOCAL], req->pre_submit_kt);
 		list_del_init(&req->req_pending_local);
 	}
 
 	if ((old_net & RQ_NET_PENDING) && (clear & RQ_NET_PENDING)) {
 		dec_ap_pending(peer_device);
 		++c_put;
-		req->acked_jif[peer_device->node_id] = jiffies;
+		net_jif = drbd_req_net_jif(req, peer_device->node_id);
+		if (net_jif) {
+			net_jif->acked_jif = jiffies;
+			if (req->rq_state[idx] & RQ_NET_OK)
+				drbd_lat_account(&peer_device->lat->stage[LAT_ACK],
+						 net_jif->pre_send_kt);
+		}
 		advance_conn_req_ack_pending(peer_device, req);
 	}
 
@@ -724,7 +776,9 @@ static void mod_rq_state(struct drbd_request *req, struct bio_and_error *m,
 			atomic_sub(req->i.size >> 9, &peer_device->connection->ap_in_flight);
 		if (old_net & RQ_EXP_BARR_ACK)
 			++k_put;
-		req->net_done_jif[peer_device->node_id] = jiffies;
+		net_jif = drbd_req_net_jif(req, peer_device->node_id);
+		if (net_jif)
+			net_jif->net_done_jif = jiffies;
 
 		/* in ahead/behind mode, or just in case,
 		 * before we finally destroy this request,
@@ -787,6 +841,19 @@ static inline bool is_pending_write_protocol_A(struct drbd_request *req, int idx
 		==  RQ_NET_PENDING;
 }
 
+/* Exponentially weighted moving average of read completion latency,
+ * in microseconds, scaled by 8 (like the tcp srtt).
+ * Called with the req_lock held. */
+static void drbd_update_read_latency(unsigned long *ewma, struct drbd_request *req)
+{
+	unsigned long sample = ktime_us_delta(ktime_get(), req->read_kt);
+
+	if (*ewma == 0)
+		*ewma = sample << 3;
+	else
+		*ewma += sample - (*ewma >> 3);
+}
+
 /* obviously this could be coded as many single functions
  * instead of one huge switch,
  * or by putting the code directly in the respective locations
@@ -848,10 +915,12 @@ int __req_mod(struct drbd_request *req, enum drbd_req_event what,
 		break;
 
 	case COMPLETED_OK:
-		if (req->rq_state[0] & RQ_WRITE)
+		if (req->rq_state[0] & RQ_WRITE) {
 			device->writ_cnt += req->i.size >> 9;
-		else
+		} else {
 			device->read_cnt += req->i.size >> 9;
+			drbd_update_read_latency(&device->read_lat_ewma, req);
+		}
 
 		mod_rq_state(req, m, peer_device, RQ_LOCAL_PENDING,
 				RQ_LOCAL_COMPLETED|RQ_LOCAL_OK);
@@ -896,7 +965,9 @@ int __req_mod(struct drbd_request *req, enum drbd_req_event what,
 		 * Corresponding drbd_remove_request_interval is in
 		 * drbd_req_complete() */
 		D_ASSERT(device, drbd_interval_empty(&req->i));
+		spin_lock(&device->interval_lock);
 		drbd_insert_interval(&device->read_requests, &req->i);
+		spin_unlock(&device->interval_lock);
 
 		set_bit(UNPLUG_REMOTE, &device->flags);
 
@@ -1109,6 +1180,7 @@ int __req_mod(struct drbd_request *req, enum drbd_req_event what,
 
 	case DATA_RECEIVED:
 		D_ASSERT(device, req->rq_state[idx] & RQ_NET_PENDING);
+		drbd_update_read_latency(&peer_device->read_lat_ewma, req);
 		mod_rq_state(req, m, peer_device, RQ_NET_PENDING, RQ_NET_OK|RQ_NET_DONE);
 		break;
 
@@ -1196,6 +1268,128 @@ static bool remote_due_to_read_balancing(struct drbd_device *device,
 	}
 }
 
+/* Switch the read target only if the other one is clearly faster,
+ * and every so often send a read to the runner-up,
+ * so its estimate follows changes in its load. */
+#define READ_LAT_HYSTERESIS_SHIFT	3	/* 12.5% */
+#define READ_LAT_PROBE_INTERVAL		64
+
+/* Called with the req_lock held.
+ * Returns the peer device to read from, or NULL to read locally.
+ * A target without an estimate yet (0) is tried first. */
+static struct drbd_peer_device *read_target_by_latency(struct drbd_request *req)
+{
+	struct drbd_device *device = req->device;
+	struct drbd_peer_device *peer_device, *best = NULL, *chosen = NULL, *other = NULL;
+	unsigned long best_lat = ULONG_MAX, chosen_lat = ULONG_MAX, other_lat = ULONG_MAX;
+	bool have_chosen = false;
+
+	/* below, a NULL peer_device stands for the local disk */
+	if (req->private_bio) {
+		best_lat = device->read_lat_ewma;
+		if (device->read_lat_node_id == -1) {
+			chosen_lat = best_lat;
+			have_chosen = true;
+		}
+	}
+
+	for_each_peer_device(peer_device, device) {
+		unsigned long lat = peer_device->read_lat_ewma;
+
+		if (peer_device->disk_state[NOW] != D_UP_TO_DATE)
+			continue;
+		if (peer_device->node_id == device->read_lat_node_id) {
+			chosen = peer_device;
+			chosen_lat = lat;
+			have_chosen = true;
+		}
+		if (lat < best_lat) {
+			best = peer_device;
+			best_lat = lat;
+		}
+	}
+
+	if (!have_chosen ||
+	    best_lat + (best_lat >> READ_LAT_HYSTERESIS_SHIFT) < chosen_lat) {
+		chosen = best;
+		device->read_lat_node_id = chosen ? chosen->node_id : -1;
+	}
+
+	if (++device->read_lat_reads % READ_LAT_PROBE_INTERVAL)
+		return chosen;
+
+	/* probe the fastest of the other targets */
+	if (chosen && req->private_bio)
+		other_lat = device->read_lat_ewma;
+	for_each_peer_device(peer_device, device) {
+		if (peer_device->disk_state[NOW] != D_UP_TO_DATE || peer_device == chosen)
+			continue;
+		if (peer_device->read_lat_ewma < other_lat) {
+			other = peer_device;
+			other_lat = peer_device->read_lat_ewma;
+		}
+	}
+	return other_lat != ULONG_MAX ? other : chosen;
+}
+
+/* Inserts into the write_requests tree and counts the interval in the
+ * write_filter.  Called with the req_lock held.  Once the filter holds more
+ * intervals than it can tell apart, drbd_write_filter_grow() gives it more
+ * slots. */
+void drbd_insert_write_interval(struct drbd_device *device, struct drbd_interval *i)
+{
+	bool grow;
+
+	spin_lock(&device->interval_lock);
+	drbd_insert_interval(&device->write_requests, i);
+	grow = drbd_filter_insert(&device->write_filter, i->sector, i->size);
+	spin_unlock(&device->interval_lock);
+	if (!grow)
+		return;
+
+	kref_get(&device->kref);
+	kref_debug_get(&device->kref_debug, 7);
+	if (!schedule_work(&device->write_filter_work)) {
+		/* already queued, we are not the last reference */
+		kref_debug_put(&device->kref_debug, 7);
+		kref_put(&device->kref, drbd_destroy_device);
+	}
+}
+
+/* Called with the req_lock held */
+void drbd_remove_write_interval(struct drbd_device *device, struct drbd_interval *i)
+{
+	spin_lock(&device->interval_lock);
+	drbd_remove_interval(&device->write_requests, i);
+	drbd_filter_remove(&device->write_filter, i->sector, i->size);
+	spin_unlock(&device->interval_lock);
+}
+
+void drbd_write_filter_grow(struct work_struct *ws)
+{
+	struct drbd_device *device = container_of(ws, struct drbd_device, write_filter_work);
+	struct drbd_resource *resource = device->resource;
+	unsigned int shift = ACCESS_ONCE(device->write_filter.shift) + 1;
+	unsigned int *count;
+
+	/* The rebuild walks the tree once, under the req_lock.  With the
+	 * number of slots doubling each time, that happens at most
+	 * DRBD_IFILTER_MAX_SHIFT - DRBD_IFILTER_MIN_SHIFT times. */
+	count = drbd_filter_alloc_slots(shift);
+	if (count) {
+		spin_lock_irq(&resource->req_lock);
+		spin_lock(&device->interval_lock);
+		count = drbd_filter_resize(&device->write_filter, &device->write_requests,
+					   count, shift);
+		spin_unlock(&device->interval_lock);
+		spin_unlock_irq(&resource->req_lock);
+		drbd_filter_free_slots(&device->write_filter, count);
+	}
+
+	kref_debug_put(&device->kref_debug, 7);
+	kref_put(&device->kref, drbd_destroy_device);
+}
+
 /*
  * complete_conflicting_writes  -  wait for any conflicting write requests
  *
@@ -1213,6 +1407,8 @@ static void complete_conflicting_writes(struct drbd_request *req)
 	sector_t sector = req->i.sector;
 	int size = req->i.size;
 
+	if (!drbd_filter_may_overlap(&device->write_filter, sector, size))
+		return;
 	i = drbd_find_overlap(&device->write_requests, sector, size);
 	if (!i)
 		return;
@@ -1342,6 +1538,11 @@ static struct drbd_peer_device *find_peer_device_for_read(struct drbd_request *r
 		}
 	}
 
+	if (rbm == RB_LEAST_LATENCY) {
+		peer_device = read_target_by_latency(req);
+		goto found;
+	}
+
 	/* TODO: improve read balancing decisions, take into account drbd
 	 * protocol, all peers, pending requests etc. */
 
@@ -1403,7 +1604,7 @@ static int drbd_process_write_request(struct drbd_request *req)
 			if (!in_tree) {
 				/* Corresponding drbd_remove_request_interval is in
 				 * drbd_req_complete() */
-				drbd_insert_interval(&device->write_requests, &req->i);
+				drbd_insert_write_interval(device, &req->i);
 				in_tree = true;
 			}
 			_req_mod(req, QUEUE_FOR_NET_WRITE, peer_device);
@@ -1443,17 +1644,218 @@ drbd_submit_req_private_bio(struct drbd_request *req)
 
 static void drbd_queue_write(struct drbd_device *device, struct drbd_request *req)
 {
+	struct submit_queue *queue;
+	int cpu;
+
 	atomic_inc(&device->ap_actlog_cnt);
-	spin_lock_irq(&device->resource->req_lock);
-	list_add_tail(&req->tl_requests, &device->submit.writes);
-	list_add_tail(&req->req_pending_master_completion,
-			&device->pending_master_completion[1 /* WRITE */]);
-	spin_unlock_irq(&device->resource->req_lock);
+
+	/* The incoming list is per cpu, do_submit() collects them, and puts
+	 * them on pending_master_completion, under the req_lock.  Until then,
+	 * debugfs finds them through drbd_oldest_queued_write(). */
+	cpu = get_cpu();
+	queue = per_cpu_ptr(device->submit.queues, cpu);
+	if (!spin_trylock_irq(&queue->lock)) {
+		queue->lock_contended++;
+		spin_lock_irq(&queue->lock);
+	}
+	list_add_tail(&req->tl_requests, &queue->writes);
+	queue->queued++;
+	spin_unlock_irq(&queue->lock);
+	cpumask_set_cpu(cpu, device->submit.pending_cpus);
+	put_cpu();
+	ACCESS_ONCE(device->submit.queued_end) = req->i.sector + (req->i.size >> 9);
+
 	queue_work(device->submit.wq, &device->submit.worker);
 	/* do_submit() may sleep internally on al_wait, too */
 	wake_up(&device->al_wait);
 }
 
+static unsigned int al_extent_of(sector_t sector)
+{
+	return sector >> (AL_EXTENT_SHIFT - 9);
+}
+
+/* Plain writes that do not cross an activity log extent boundary.
+ * Keeping merged requests within one extent means the merged request
+ * can simply take over the activity log reference of the first one. */
+static bool may_coalesce(struct drbd_request *req)
+{
+	struct bio *bio = req->master_bio;
+
+	return bio_data_dir(bio) == WRITE && req->i.size &&
+		!(bio->bi_rw & (DRBD_REQ_FLUSH | DRBD_REQ_FUA | DRBD_REQ_DISCARD)) &&
+		al_extent_of(req->i.sector) ==
+		al_extent_of(req->i.sector + (req->i.size >> 9) - 1);
+}
+
+/* Racy, but only decides whether a write goes through the submitter,
+ * where it may be merged with the write it follows, or takes the
+ * activity log fast path right away. */
+static bool follows_queued_write(struct drbd_device *device, struct drbd_request *req)
+{
+	return atomic_read(&device->ap_actlog_cnt) &&
+		ACCESS_ONCE(device->submit.queued_end) == req->i.sector;
+}
+
+static bool may_append(struct drbd_request *prev, struct drbd_request *next)
+{
+	return may_coalesce(next) &&
+		next->i.sector == prev->i.sector + (prev->i.size >> 9) &&
+		al_extent_of(next->i.sector) == al_extent_of(prev->i.sector) &&
+		next->master_bio->bi_rw == prev->master_bio->bi_rw &&
+		!next->private_bio == !prev->private_bio &&
+		(next->rq_state[0] & RQ_IN_ACT_LOG) == (prev->rq_state[0] & RQ_IN_ACT_LOG);
+}
+
+/* The master bios of coalesced requests are chained through bi_next */
+static BIO_ENDIO_TYPE drbd_coalesced_endio BIO_ENDIO_ARGS(struct bio *bio, int error)
+{
+	struct bio *orig = bio->bi_private;
+
+	BIO_ENDIO_FN_START;
+	while (orig) {
+		struct bio *next = orig->bi_next;
+
+		orig->bi_next = NULL;
+		bio_endio(orig, error);
+		orig = next;
+	}
+	bio_put(bio);
+	BIO_ENDIO_FN_RETURN;
+}
+
+/* Replace the requests first..last on a list with one new request, covering
+ * all of them.  Its master bio refers to the pages of the original master
+ * bios, and completes them when it is completed itself.  The new request
+ * inherits the ldev and activity log references of @first; the references
+ * of all others are dropped here.  All of them are neither in the transfer
+ * log nor in the interval tree yet. */
+static struct drbd_request *
+coalesce_requests(struct drbd_device *device, struct drbd_request *first, struct drbd_request *last,
+		  unsigned int size, unsigned int nr_vecs)
+{
+	struct drbd_request *req, *tmp, *new;
+	struct bio *bio, **tail;
+	DRBD_BIO_VEC_TYPE bvec;
+	DRBD_ITER_TYPE iter;
+	LIST_HEAD(merged);
+
+	bio = bio_kmalloc(GFP_NOIO | __GFP_NOWARN, nr_vecs);
+	if (!bio)
+		return NULL;
+	bio->bi_bdev = first->master_bio->bi_bdev;
+	bio->bi_rw = first->master_bio->bi_rw;
+	bio->bi_end_io = drbd_coalesced_endio;
+	DRBD_BIO_BI_SECTOR(bio) = first->i.sector;
+	DRBD_BIO_BI_SIZE(bio) = size;
+	req = first;
+	for (;;) {
+		bio_for_each_segment(bvec, req->master_bio, iter) {
+			struct bio_vec *bv = &bio->bi_io_vec[bio->bi_vcnt++];
+
+			bv->bv_page = bvec BVD bv_page;
+			bv->bv_len = bvec BVD bv_len;
+			bv->bv_offset = bvec BVD bv_offset;
+		}
+		if (req == last)
+			break;
+		req = list_next_entry(req, tl_requests);
+	}
+
+	new = drbd_req_new(device, bio);
+	if (!new) {
+		bio_put(bio);
+		return NULL;
+	}
+	if (!first->private_bio) {
+		bio_put(new->private_bio);
+		new->private_bio = NULL;
+	}
+	new->start_jif = first->start_jif;
+	new->start_kt = first->start_kt;
+	new->in_actlog_jif = first->in_actlog_jif;
+	new->rq_state[0] |= first->rq_state[0] & RQ_IN_ACT_LOG;
+
+	tail = (struct bio **)&bio->bi_private;
+	spin_lock_irq(&device->resource->req_lock);
+	list_add_tail(&new->tl_requests, &first->tl_requests);
+	list_add_tail(&new->req_pending_master_completion,
+			&device->pending_master_completion[1 /* WRITE */]);
+	req = first;
+	for (;;) {
+		tmp = list_next_entry(req, tl_requests);
+		list_move_tail(&req->tl_requests, &merged);
+		list_del_init(&req->req_pending_master_completion);
+		*tail = req->master_bio;
+		tail = &req->master_bio->bi_next;
+		/* the new request accounts for all of them when it completes */
+		new->coalesced += req->coalesced;
+		if (req != first) {
+			new->coalesced++;
+			device->submit.coalesced++;
+		}
+		if (req == last)
+			break;
+		req = tmp;
+	}
+	spin_unlock_irq(&device->resource->req_lock);
+
+	list_for_each_entry_safe(req, tmp, &merged, tl_requests) {
+		if (req->private_bio) {
+			bio_put(req->private_bio);
+			if (req != first) {
+				if (req->rq_state[0] & RQ_IN_ACT_LOG)
+					drbd_al_complete_io(device, &req->i);
+				put_ldev(device);
+			}
+		}
+		if (req != first)
+			dec_ap_bio(device, WRITE);
+		list_del(&req->tl_requests);
+		kref_debug_put(&device->kref_debug, 6);
+		kref_put(&device->kref, drbd_destroy_device);
+		drbd_req_free(req);
+	}
+	return new;
+}
+
+/* Merge runs of contiguous writes on @list (linked by tl_requests).
+ * They have been through the activity log already, if they need to. */
+static void coalesce_pending_writes(struct drbd_device *device, struct list_head *list)
+{
+	unsigned int max_size = queue_max_hw_sectors(device->rq_queue) << 9;
+	struct drbd_request *req, *last, *new;
+
+	list_for_each_entry(req, list, tl_requests) {
+		unsigned int size = req->i.size;
+		unsigned int nr_vecs = bio_segments(req->master_bio);
+		unsigned int nr = 1;
+
+		if (!may_coalesce(req))
+			continue;
+
+		last = req;
+		while (last->tl_requests.next != list) {
+			struct drbd_request *next = list_next_entry(last, tl_requests);
+			unsigned int next_vecs = bio_segments(next->master_bio);
+
+			if (!may_append(last, next) ||
+			    size + next->i.size > max_size ||
+			    nr_vecs + next_vecs > BIO_MAX_PAGES)
+				break;
+			size += next->i.size;
+			nr_vecs += next_vecs;
+			nr++;
+			last = next;
+		}
+		if (nr == 1)
+			continue;
+
+		new = coalesce_requests(device, req, last, size, nr_vecs);
+		req = new ?: last;
+	}
+}
+
 /* returns the new drbd_request pointer, if the caller is expected to
  * drbd_send_and_submit() it (to save latency), or NULL if we queued the
  * request on the submitter thread.
@@ -1476,6 +1878,7 @@ drbd_request_prepare(struct drbd_device *device, struct bio *bio, unsigned long
 		return ERR_PTR(-ENOMEM);
 	}
 	req->start_jif = start_jif;
+	req->start_kt = ktime_get();
 
 	if (!get_ldev(device)) {
 		bio_put(req->private_bio);
@@ -1494,6 +1897,13 @@ drbd_request_prepare(struct drbd_device *device, struct bio *bio, unsigned long
 		}
 
 		if (req->private_bio && !test_bit(AL_SUSPENDED, &device->flags)) {
+			/* Give the submitter a chance to merge it with the
+			 * write it follows, it takes the fast path there as well */
+			if (coalesce_writes && may_coalesce(req) &&
+			    follows_queued_write(device, req)) {
+				drbd_queue_write(device, req);
+				return NULL;
+			}
 			if (!drbd_al_begin_io_fastpath(device, &req->i)) {
 				drbd_queue_write(device, req);
 				return NULL;
@@ -1526,6 +1936,9 @@ static void drbd_send_and_submit(struct drbd_device *device, struct drbd_request
 		/* check for congestion, and potentially stop sending
 		 * full data updates, but start sending "dirty bits" only. */
 		maybe_pull_ahead(device);
+
+		if (req->rq_state[0] & RQ_IN_ACT_LOG)
+			drbd_lat_account(&device->lat->stage[LAT_AL], req->start_kt);
 	}
 
 
@@ -1547,6 +1960,9 @@ static void drbd_send_and_submit(struct drbd_device *device, struct drbd_request
 		peer_device = find_peer_device_for_read(req);
 		if (!peer_device && !req->private_bio)
 			goto nodata;
+		req->read_kt = ktime_get();
+		if (peer_device)
+			req->read_cache_seq = drbd_read_cache_seq(device);
 	}
 
 	/* which transfer log epoch does this belong to? */
@@ -1596,6 +2012,7 @@ static void drbd_send_and_submit(struct drbd_device *device, struct drbd_request
 	if (req->private_bio) {
 		/* needs to be marked within the same spinlock */
 		req->pre_submit_jif = jiffies;
+		req->pre_submit_kt = ktime_get();
 		list_add_tail(&req->req_pending_local,
 			&device->pending_completion[rw == WRITE]);
 		_req_mod(req, TO_BE_SUBMITTED, NULL);
@@ -1643,6 +2060,8 @@ void __drbd_make_request(struct drbd_device *device, struct bio *bio, unsigned l
 static void submit_fast_path(struct drbd_device *device, struct list_head *incoming)
 {
 	struct drbd_request *req, *tmp;
+	LIST_HEAD(fast);
+
 	list_for_each_entry_safe(req, tmp, incoming, tl_requests) {
 		const int rw = bio_data_dir(req->master_bio);
 
@@ -1656,6 +2075,13 @@ static void submit_fast_path(struct drbd_device *device, struct list_head *incom
 			atomic_dec(&device->ap_actlog_cnt);
 		}
 
+		list_move_tail(&req->tl_requests, &fast);
+	}
+
+	if (coalesce_writes)
+		coalesce_pending_writes(device, &fast);
+
+	list_for_each_entry_safe(req, tmp, &fast, tl_requests) {
 		list_del_init(&req->tl_requests);
 		drbd_send_and_submit(device, req);
 	}
@@ -1692,10 +2118,16 @@ void send_and_submit_pending(struct drbd_device *device, struct list_head *pendi
 {
 	struct drbd_request *req, *tmp;
 
-	list_for_each_entry_safe(req, tmp, pending, tl_requests) {
+	list_for_each_entry(req, pending, tl_requests) {
 		req->rq_state[0] |= RQ_IN_ACT_LOG;
 		req->in_actlog_jif = jiffies;
 		atomic_dec(&device->ap_actlog_cnt);
+	}
+
+	if (coalesce_writes)
+		coalesce_pending_writes(device, pending);
+
+	list_for_each_entry_safe(req, tmp, pending, tl_requests) {
 		list_del_init(&req->tl_requests);
 		drbd_send_and_submit(device, req);
 	}
@@ -1712,17 +2144,84 @@ static void ensure_current_uuid(struct drbd_device *device)
 	}
 }
 
+static bool submit_queues_empty(struct drbd_device *device)
+{
+	return cpumask_empty(device->submit.pending_cpus);
+}
+
+/* The oldest write still waiting in the per cpu queues of drbd_queue_write(),
+ * for debugfs.  The caller holds the req_lock, which keeps it from being
+ * put on pending_master_completion, and from completing. */
+struct drbd_request *drbd_oldest_queued_write(struct drbd_device *device)
+{
+	struct drbd_request *oldest = NULL;
+	int cpu;
+
+	for_each_cpu(cpu, device->submit.pending_cpus) {
+		struct submit_queue *queue = per_cpu_ptr(device->submit.queues, cpu);
+		struct drbd_request *req;
+
+		spin_lock(&queue->lock);
+		req = list_first_entry_or_null(&queue->writes, struct drbd_request, tl_requests);
+		if (req && (!oldest || time_before(req->start_jif, oldest->start_jif)))
+			oldest = req;
+		spin_unlock(&queue->lock);
+	}
+	return oldest;
+}
+
+/* merge the per cpu incoming lists of drbd_queue_write() into @incoming */
+static void grab_incoming_writes(struct drbd_device *device, struct list_head *incoming)
+{
+	struct drbd_request *req;
+	LIST_HEAD(grabbed);
+	int cpu;
+
+	device->submit.merges++;
+	/* drbd_queue_write() sets the bit after queueing, so clearing it
+	 * before draining the queue never loses a write. */
+	for_each_cpu(cpu, device->submit.pending_cpus) {
+		struct submit_queue *queue = per_cpu_ptr(device->submit.queues, cpu);
+
+		cpumask_clear_cpu(cpu, device->submit.pending_cpus);
+		spin_lock_irq(&queue->lock);
+		list_splice_tail_init(&queue->writes, &grabbed);
+		spin_unlock_irq(&queue->lock);
+	}
+	if (list_empty(&grabbed))
+		return;
+
+	/* one req_lock round trip per batch, not per write */
+	spin_lock_irq(&device->resource->req_lock);
+	list_for_each_entry(req, &grabbed, tl_requests)
+		list_add_tail(&req->req_pending_master_completion,
+				&device->pending_master_completion[1 /* WRITE */]);
+	spin_unlock_irq(&device->resource->req_lock);
+	list_splice_tail_init(&grabbed, incoming);
+}
+
+/* The AL transaction the requests on @in_flight wait for has been submitted
+ * by drbd_al_commit_start(); wait for it, then send and submit them. */
+static void finish_al_commit(struct drbd_device *device, struct list_head *in_flight)
+{
+	drbd_al_commit_wait(device);
+	drbd_al_prefetch_release(device);
+	ensure_current_uuid(device);
+	send_and_submit_pending(device, in_flight);
+}
+
 void do_submit(struct work_struct *ws)
 {
 	struct drbd_device *device = container_of(ws, struct drbd_device, submit.worker);
 	LIST_HEAD(incoming);	/* from drbd_make_request() */
 	LIST_HEAD(pending);	/* to be submitted after next AL-transaction commit */
 	LIST_HEAD(busy);	/* blocked by resync requests */
+	LIST_HEAD(in_flight);	/* to be submitted after the AL-transaction in flight */
+	bool pipeline = pipeline_al_commits;
+	bool committing = false;
 
 	/* grab new incoming requests */
-	spin_lock_irq(&device->resource->req_lock);
-	list_splice_tail_init(&device->submit.writes, &incoming);
-	spin_unlock_irq(&device->resource->req_lock);
+	grab_incoming_writes(device, &incoming);
 
 	for (;;) {
 		DEFINE_WAIT(wait);
@@ -1743,6 +2242,15 @@ void do_submit(struct work_struct *ws)
 			if (!list_empty(&pending))
 				break;
 
+			/* Nothing to put into the next transaction yet;
+			 * don't sleep on the one still in flight. */
+			if (committing) {
+				finish_wait(&device->al_wait, &wait);
+				finish_al_commit(device, &in_flight);
+				committing = false;
+				continue;
+			}
+
 			schedule();
 
 			/* If all currently "hot" activity log extents are kept busy by
@@ -1762,9 +2270,7 @@ void do_submit(struct work_struct *ws)
 			/* Nothing moved to pending, but nothing left
 			 * on incoming: all moved to busy!
 			 * Grab new and iterate. */
-			spin_lock_irq(&device->resource->req_lock);
-			list_splice_tail_init(&device->submit.writes, &incoming);
-			spin_unlock_irq(&device->resource->req_lock);
+			grab_incoming_writes(device, &incoming);
 		}
 		finish_wait(&device->al_wait, &wait);
 
@@ -1791,12 +2297,10 @@ void do_submit(struct work_struct *ws)
 
 			/* It is ok to look outside the lock,
 			 * it's only an optimization anyways */
-			if (list_empty(&device->submit.writes))
+			if (submit_queues_empty(device))
 				break;
 
-			spin_lock_irq(&device->resource->req_lock);
-			list_splice_tail_init(&device->submit.writes, &more_incoming);
-			spin_unlock_irq(&device->resource->req_lock);
+			grab_incoming_writes(device, &more_incoming);
 
 			if (list_empty(&more_incoming))
 				break;
@@ -1809,12 +2313,42 @@ void do_submit(struct work_struct *ws)
 				break;
 		}
 
-		drbd_al_begin_io_commit(device);
+		if (!pipeline) {
+			drbd_al_begin_io_commit(device);
+			drbd_al_prefetch_release(device);
 
-		ensure_current_uuid(device);
+			ensure_current_uuid(device);
+
+			send_and_submit_pending(device, &pending);
+			continue;
+		}
 
-		send_and_submit_pending(device, &pending);
+		/* With pipelined commits, the requests for the next transaction
+		 * have been collected while the previous one was written.
+		 * Finish that one, and get the next one going, before we
+		 * submit the requests that waited for the previous one. */
+		if (committing) {
+			drbd_al_commit_wait(device);
+			drbd_al_prefetch_release(device);
+			committing = false;
+		}
+		committing = drbd_al_commit_start(device);
+		if (!committing)
+			drbd_al_prefetch_release(device);
+		if (!list_empty(&in_flight)) {
+			ensure_current_uuid(device);
+			send_and_submit_pending(device, &in_flight);
+		}
+		if (committing) {
+			list_splice_tail_init(&pending, &in_flight);
+		} else {
+			ensure_current_uuid(device);
+			send_and_submit_pending(device, &pending);
+		}
 	}
+
+	if (committing)
+		finish_al_commit(device, &in_flight);
 }
 
 MAKE_REQUEST_TYPE drbd_make_request(struct request_queue *q, struct bio *bio)
@@ -1838,12 +2372,187 @@ MAKE_REQUEST_TYPE drbd_make_request(struct request_queue *q, struct bio *bio)
 	 */
 	D_ASSERT(device, IS_ALIGNED(DRBD_BIO_BI_SIZE(bio), 512));
 
+	if (drbd_read_cache_lookup(device, bio))
+		MAKE_REQUEST_RETURN;
+
 	inc_ap_bio(device, bio_data_dir(bio));
 	__drbd_make_request(device, bio, start_jif);
 
 	MAKE_REQUEST_RETURN;
 }
 
+#ifdef COMPAT_HAVE_BLK_MQ
+/* With use_blk_mq, the block layer does merging and tag based limiting
+ * of in-flight requests for us, and hands us struct requests per hardware
+ * context.  Each of them is mapped onto one bio, which is then processed
+ * like any other master bio; its completion ends the request, right there.
+ *
+ * inc_ap_bio() and request allocation may sleep.  With BLK_MQ_F_BLOCKING,
+ * ->queue_rq() may, too, and submits directly.  Older kernels may call
+ * ->queue_rq() with preemption disabled; there the submission is done
+ * from a work item, which, as the workqueue is per cpu, runs on the cpu
+ * that queued the request. */
+
+/* tags per hardware context */
+#define DRBD_MQ_QUEUE_DEPTH	128
+/* larger requests get their bio_vecs from kmalloc */
+#define DRBD_MQ_INLINE_VECS	16
+
+struct drbd_mq_cmd {
+#ifndef COMPAT_HAVE_BLK_MQ_F_BLOCKING
+	struct work_struct work;
+#endif
+	unsigned long start_jif;
+	struct bio bio;
+	struct bio_vec inline_vecs[DRBD_MQ_INLINE_VECS];
+};
+
+static BIO_ENDIO_TYPE drbd_mq_endio BIO_ENDIO_ARGS(struct bio *bio, int error)
+{
+	struct drbd_mq_cmd *cmd = container_of(bio, struct drbd_mq_cmd, bio);
+
+	BIO_ENDIO_FN_START;
+	if (bio->bi_io_vec != cmd->inline_vecs)
+		kfree(bio->bi_io_vec);
+	blk_mq_end_request(blk_mq_rq_from_pdu(cmd), error);
+	BIO_ENDIO_FN_RETURN;
+}
+
+static void drbd_mq_submit(struct drbd_mq_cmd *cmd)
+{
+	struct request *rq = blk_mq_rq_from_pdu(cmd);
+	struct drbd_device *device = rq->q->queuedata;
+	struct bio *bio = &cmd->bio;
+	struct bio_vec bvec, *vecs = cmd->inline_vecs;
+	struct req_iterator iter;
+	unsigned int nr = 0;
+
+	if (!(rq->cmd_flags & REQ_DISCARD)) {
+		rq_for_each_segment(bvec, rq, iter)
+			nr++;
+		if (nr > DRBD_MQ_INLINE_VECS) {
+			vecs = kmalloc_array(nr, sizeof(*vecs), GFP_NOIO);
+			if (!vecs) {
+				blk_mq_end_request(rq, -ENOMEM);
+				return;
+			}
+		}
+		nr = 0;
+		rq_for_each_segment(bvec, rq, iter)
+			vecs[nr++] = bvec;
+	}
+
+	bio_init(bio);
+	bio->bi_io_vec = vecs;
+	bio->bi_max_vecs = max_t(unsigned int, nr, DRBD_MQ_INLINE_VECS);
+	bio->bi_vcnt = nr;
+	bio->bi_bdev = device->this_bdev;
+	bio->bi_rw = rq->cmd_flags & REQ_COMMON_MASK;
+	bio->bi_end_io = drbd_mq_endio;
+	DRBD_BIO_BI_SECTOR(bio) = blk_rq_pos(rq);
+	DRBD_BIO_BI_SIZE(bio) = blk_rq_bytes(rq);
+
+	if (drbd_read_cache_lookup(device, bio))
+		return;
+
+	inc_ap_bio(device, bio_data_dir(bio));
+	__drbd_make_request(device, bio, cmd->start_jif);
+}
+
+#ifndef COMPAT_HAVE_BLK_MQ_F_BLOCKING
+static void drbd_mq_submit_work(struct work_struct *ws)
+{
+	drbd_mq_submit(container_of(ws, struct drbd_mq_cmd, work));
+}
+#endif
+
+static int drbd_mq_queue_rq(struct blk_mq_hw_ctx *hctx, const struct blk_mq_queue_data *bd)
+{
+	struct drbd_mq_cmd *cmd = blk_mq_rq_to_pdu(bd->rq);
+
+	blk_mq_start_request(bd->rq);
+	cmd->start_jif = jiffies;
+#ifdef COMPAT_HAVE_BLK_MQ_F_BLOCKING
+	drbd_mq_submit(cmd);
+#else
+	INIT_WORK(&cmd->work, drbd_mq_submit_work);
+	queue_work(((struct drbd_device *)hctx->queue->queuedata)->mq_wq, &cmd->work);
+#endif
+
+	return BLK_MQ_RQ_QUEUE_OK;
+}
+
+/* A request stuck with a peer or on the backing device is dealt with by
+ * DRBD's own timeouts (ko-count, timeout, disk-timeout); the block layer
+ * must not complete a request we still own. */
+static enum blk_eh_timer_return drbd_mq_timeout(struct request *rq, bool reserved)
+{
+	return BLK_EH_RESET_TIMER;
+}
+
+static struct blk_mq_ops drbd_mq_ops = {
+	.queue_rq	= drbd_mq_queue_rq,
+	.timeout	= drbd_mq_timeout,
+#ifdef COMPAT_HAVE_BLK_MQ_OPS_MAP_QUEUE
+	.map_queue	= blk_mq_map_queue,
+#endif
+};
+
+struct request_queue *drbd_mq_alloc_queue(struct drbd_device *device)
+{
+	struct blk_mq_tag_set *set = &device->tag_set;
+	struct request_queue *q;
+
+#ifndef COMPAT_HAVE_BLK_MQ_F_BLOCKING
+	device->mq_wq = alloc_workqueue("drbd%u_mq", WQ_MEM_RECLAIM | WQ_HIGHPRI, 0, device->minor);
+	if (!device->mq_wq)
+		return NULL;
+#endif
+
+	memset(set, 0, sizeof(*set));
+	set->ops = &drbd_mq_ops;
+	set->nr_hw_queues = nr_cpu_ids;
+	set->queue_depth = DRBD_MQ_QUEUE_DEPTH;
+	set->numa_node = NUMA_NO_NODE;
+	set->cmd_size = sizeof(struct drbd_mq_cmd);
+	set->flags = BLK_MQ_F_SHOULD_MERGE;
+#ifdef COMPAT_HAVE_BLK_MQ_F_BLOCKING
+	set->flags |= BLK_MQ_F_BLOCKING;
+#endif
+	set->driver_data = device;
+	if (blk_mq_alloc_tag_set(set))
+		goto out_no_tag_set;
+
+	q = blk_mq_init_queue(set);
+	if (IS_ERR(q))
+		goto out_no_queue;
+	return q;
+
+out_no_queue:
+	blk_mq_free_tag_set(set);
+out_no_tag_set:
+	set->ops = NULL;
+#ifndef COMPAT_HAVE_BLK_MQ_F_BLOCKING
+	destroy_workqueue(device->mq_wq);
+	device->mq_wq = NULL;
+#endif
+	return NULL;
+}
+
+/* after blk_cleanup_queue() */
+void drbd_mq_free_queue(struct drbd_device *device)
+{
+	if (!device->tag_set.ops)
+		return;
+	blk_mq_free_tag_set(&device->tag_set);
+	device->tag_set.ops = NULL;
+#ifndef COMPAT_HAVE_BLK_MQ_F_BLOCKING
+	destroy_workqueue(device->mq_wq);
+	device->mq_wq = NULL;
+#endif
+}
+#endif
+
 /* This is called by bio_add_page().
  *
  * q->max_hw_sectors and other global limits are already enforced there.
@@ -1887,6 +2596,16 @@ static unsigned long time_min_in_future(unsigned long now,
 	return time_after(t1, t2) ? t2 : t1;
 }
 
+/* A request allocated before a connection with a higher node id came up
+ * may not have a slot for it, see drbd_req_net_jif().  Fall back to the
+ * start time then, which is earlier than the actual send. */
+static unsigned long req_pre_send_jif(struct drbd_request *req, int node_id)
+{
+	struct drbd_request_net_jif *net_jif = drbd_req_net_jif(req, node_id);
+
+	return net_jif ? net_jif->pre_send_jif : req->start_jif;
+}
+
 static bool net_timeout_reached(struct drbd_request *net_req,
 		struct drbd_connection *connection,
 		unsigned long now, unsigned long ent,
@@ -1895,8 +2614,9 @@ static bool net_timeout_reached(struct drbd_request *net_req,
 	struct drbd_device *device = net_req->device;
 	struct drbd_peer_device *peer_device = conn_peer_device(connection, device->vnr);
 	int peer_node_id = peer_device->node_id;
+	unsigned long pre_send_jif = req_pre_send_jif(net_req, peer_node_id);
 
-	if (!time_after(now, net_req->pre_send_jif[peer_node_id] + ent))
+	if (!time_after(now, pre_send_jif + ent))
 		return false;
 
 	if (time_in_range(now, connection->last_reconnect_jif, connection->last_reconnect_jif + ent))
@@ -1904,7 +2624,7 @@ static bool net_timeout_reached(struct drbd_request *net_req,
 
 	if (net_req->rq_state[1 + peer_node_id] & RQ_NET_PENDING) {
 		drbd_warn(device, "Remote failed to finish a request within %ums > ko-count (%u) * timeout (%u * 0.1s)\n",
-			jiffies_to_msecs(now - net_req->pre_send_jif[peer_node_id]), ko_count, timeout);
+			jiffies_to_msecs(now - pre_send_jif), ko_count, timeout);
 		return true;
 	}
 
@@ -1915,7 +2635,7 @@ static bool net_timeout_reached(struct drbd_request *net_req,
 	if (net_req->epoch == connection->send.current_epoch_nr) {
 		drbd_warn(device,
 			"We did not send a P_BARRIER for %ums > ko-count (%u) * timeout (%u * 0.1s); drbd kernel thread blocked?\n",
-			jiffies_to_msecs(now - net_req->pre_send_jif[peer_node_id]), ko_count, timeout);
+			jiffies_to_msecs(now - pre_send_jif), ko_count, timeout);
 		return false;
 	}
 
@@ -2049,7 +2769,7 @@ void request_timer_fn(unsigned long data)
 		if (!timeout)
 			continue;
 
-		pre_send_jif = req->pre_send_jif[connection->peer_node_id];
+		pre_send_jif = req_pre_send_jif(req, connection->peer_node_id);
 
 		ent = timeout * HZ/10 * ko_count;
 		et = min_not_zero(et, ent);
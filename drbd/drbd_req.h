@@ -287,6 +287,20 @@ static inline bool drbd_req_is_write(struct drbd_request *req)
 	return req->rq_state[0] & RQ_WRITE;
 }
 
+static inline void __drbd_lat_account(struct drbd_lat_hist __percpu *hist, s64 ns)
+{
+	int bucket = ns < 1024 ? 0 : min(fls64(ns >> 10), DRBD_LAT_BUCKETS - 1);
+
+	per_cpu_ptr(hist, get_cpu())->count[bucket]++;
+	put_cpu();
+}
+
+/* account the time since @start in one of the latency histograms */
+static inline void drbd_lat_account(struct drbd_lat_hist __percpu *hist, ktime_t start)
+{
+	__drbd_lat_account(hist, ktime_to_ns(ktime_sub(ktime_get(), start)));
+}
+
 /* Short lived temporary struct on the stack.
  * We could squirrel the error to be returned into
  * bio->bi_iter.bi_size, or similar. But that would be too ugly. */
@@ -308,7 +322,12 @@ extern void request_timer_fn(unsigned long data);
 extern void tl_restart(struct drbd_connection *connection, enum drbd_req_event what);
 extern void _tl_restart(struct drbd_connection *connection, enum drbd_req_event what);
 extern void drbd_queue_peer_ack(struct drbd_resource *resource, struct drbd_request *req);
+extern void drbd_req_free(struct drbd_request *req);
 extern bool drbd_should_do_remote(struct drbd_peer_device *, enum which_state);
+extern struct drbd_request *drbd_oldest_queued_write(struct drbd_device *device);
+extern void drbd_insert_write_interval(struct drbd_device *device, struct drbd_interval *i);
+extern void drbd_remove_write_interval(struct drbd_device *device, struct drbd_interval *i);
+extern void drbd_write_filter_grow(struct work_struct *ws);
 
 /* this is in drbd_main.c */
 extern void drbd_restart_request(struct drbd_request *req);
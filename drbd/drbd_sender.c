@@ -62,12 +62,14 @@ struct mutex resources_mutex;
  */
 BIO_ENDIO_TYPE drbd_md_endio BIO_ENDIO_ARGS(struct bio *bio, int error)
 {
+	struct drbd_md_io *md_io;
 	struct drbd_device *device;
 
 	BIO_ENDIO_FN_START;
 
-	device = bio->bi_private;
-	device->md_io.error = error;
+	md_io = bio->bi_private;
+	device = md_io->device;
+	md_io->error = error;
 
 	/* We grabbed an extra reference in _drbd_md_sync_page_io() to be able
 	 * to timeout on the lower level device, and eventually detach from it.
@@ -80,8 +82,8 @@ BIO_ENDIO_TYPE drbd_md_endio BIO_ENDIO_ARGS(struct bio *bio, int error)
 	 * next drbd_md_sync_page_io(), that we trigger the
 	 * ASSERT(atomic_read(&mdev->md_io_in_use) == 1) there.
 	 */
-	drbd_md_put_buffer(device);
-	device->md_io.done = 1;
+	drbd_md_put_buffer(device, md_io - device->md_io);
+	md_io->done = 1;
 	wake_up(&device->misc_wait);
 	bio_put(bio);
 	if (device->ldev) /* special case: drbd_md_read() during drbd_adm_attach() */
@@ -641,7 +643,8 @@ static int make_resync_request(struct drbd_peer_device *peer_device, int cancel)
 	unsigned long bit;
 	sector_t sector;
 	const sector_t capacity = drbd_get_capacity(device->this_bdev);
-	int max_bio_size;
+	struct net_conf *nc;
+	int max_bio_size, mxb;
 	int number, rollback_i, size;
 	int align, requeue = 0;
 	int i = 0;
@@ -665,6 +668,15 @@ static int make_resync_request(struct drbd_peer_device *peer_device, int cancel)
 	}
 
 	max_bio_size = queue_max_hw_sectors(device->rq_queue) << 9;
+	/* Keep a single resync request to half of "max-buffers".  The peer
+	 * takes its pages from the same budget as the application writes of
+	 * this connection, see drbd_alloc_pages(). */
+	rcu_read_lock();
+	nc = rcu_dereference(peer_device->connection->transport.net_conf);
+	mxb = nc ? nc->max_buffers : 0;
+	rcu_read_unlock();
+	max_bio_size = min_t(int, max_bio_size, (mxb / 2) << PAGE_SHIFT);
+	max_bio_size = max_t(int, max_bio_size, BM_BLOCK_SIZE);
 	number = drbd_rs_number_requests(peer_device);
 	if (number <= 0)
 		goto requeue;
@@ -2464,10 +2476,17 @@ static int process_one_request(struct drbd_connection *connection)
 	struct drbd_peer_device *peer_device =
 			conn_peer_device(connection, device->vnr);
 	unsigned s = drbd_req_state_by_peer_device(req, peer_device);
+	struct drbd_request_net_jif *net_jif;
 	int err;
 	enum drbd_req_event what;
 
-	req->pre_send_jif[peer_device->node_id] = jiffies;
+	net_jif = drbd_req_net_jif(req, peer_device->node_id);
+	if (net_jif) {
+		net_jif->pre_send_jif = jiffies;
+		net_jif->pre_send_kt = ktime_get();
+		__drbd_lat_account(&peer_device->lat->stage[LAT_SEND],
+				   ktime_to_ns(ktime_sub(net_jif->pre_send_kt, req->start_kt)));
+	}
 	if (drbd_req_is_write(req)) {
 		/* If a WRITE does not expect a barrier ack,
 		 * we are supposed to only send an "out of sync" info packet */
@@ -1615,6 +1615,7 @@ static void finish_state_change(struct drbd_resource *resource, struct completio
 	bool starting_resync = false;
 	bool start_new_epoch = false;
 	bool lost_a_primary_peer = false;
+	bool drop_read_cache;
 	int vnr;
 
 	print_state_change(resource, "");
@@ -1639,10 +1640,28 @@ static void finish_state_change(struct drbd_resource *resource, struct completio
 	if (start_new_epoch)
 		start_new_tl_epoch(resource);
 
-	if (role[OLD] == R_PRIMARY && role[NEW] == R_SECONDARY && resource->peer_ack_req) {
-		resource->last_peer_acked_dagtag = resource->peer_ack_req->dagtag_sector;
-		drbd_queue_peer_ack(resource, resource->peer_ack_req);
-		resource->peer_ack_req = NULL;
+	if (role[OLD] == R_PRIMARY && role[NEW] == R_SECONDARY) {
+		spin_lock(&resource->peer_ack_lock);
+		if (resource->peer_ack_req) {
+			resource->last_peer_acked_dagtag = resource->peer_ack_req->dagtag_sector;
+			drbd_queue_peer_ack(resource, resource->peer_ack_req);
+			resource->peer_ack_req = NULL;
+		}
+		spin_unlock(&resource->peer_ack_lock);
+	}
+
+	/* We do not learn about writes of other primaries, so the read
+	 * cache of a diskless primary may only be trusted as long as
+	 * nothing changed in the cluster. */
+	drop_read_cache = role[OLD] != role[NEW];
+	for_each_connection(connection, resource) {
+		if (connection->cstate[OLD] != connection->cstate[NEW] ||
+		    connection->peer_role[OLD] != connection->peer_role[NEW])
+			drop_read_cache = true;
+	}
+	if (drop_read_cache) {
+		idr_for_each_entry(&resource->devices, device, vnr)
+			drbd_read_cache_clear(device);
 	}
 
 	idr_for_each_entry(&resource->devices, device, vnr) {
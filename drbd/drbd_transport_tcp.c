@@ -38,6 +38,11 @@ MODULE_DESCRIPTION("TCP (SDP, SSOCKS) transport layer for DRBD");
 MODULE_LICENSE("GPL");
 MODULE_VERSION("1.0.0");
 
+static unsigned int ack_busy_poll;
+MODULE_PARM_DESC(ack_busy_poll, "Busy poll the control socket for this many usecs "
+		 "before sleeping for acks (0 = off, applies to new connections)");
+module_param(ack_busy_poll, uint, 0644);
+
 struct buffer {
 	void *base;
 	void *pos;
@@ -109,6 +114,20 @@ static void dtt_nodelay(struct socket *socket)
 	(void) kernel_setsockopt(socket, SOL_TCP, TCP_NODELAY, (char *)&val, sizeof(val));
 }
 
+/* Acks for writes arrive on the control socket.  With busy polling, a
+ * blocking receive spins on the NIC's receive queue for a while instead
+ * of waiting for the interrupt; that trades cpu time for ack latency.
+ * Only effective with NICs that support busy polling. */
+static void dtt_busy_poll(struct socket *socket)
+{
+#ifdef SO_BUSY_POLL
+	int val = ack_busy_poll;
+
+	if (val)
+		(void) kernel_setsockopt(socket, SOL_SOCKET, SO_BUSY_POLL, (char *)&val, sizeof(val));
+#endif
+}
+
 int dtt_init(struct drbd_transport *transport)
 {
 	struct drbd_tcp_transport *tcp_transport =
@@ -868,6 +887,7 @@ randomize:
 	 * we use TCP_CORK where appropriate, though */
 	dtt_nodelay(dsocket);
 	dtt_nodelay(csocket);
+	dtt_busy_poll(csocket);
 
 	tcp_transport->stream[DATA_STREAM] = dsocket;
 	tcp_transport->stream[CONTROL_STREAM] = csocket;
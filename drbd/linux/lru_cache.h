@@ -209,12 +209,20 @@ struct lc_element {
 	unsigned lc_new_number;
 };
 
+/* slot of the open addressed index used by lc_try_get_lockless() */
+struct lc_index_slot {
+	unsigned int enr;	/* LC_FREE if empty */
+	unsigned int index;
+};
+
 struct lru_cache {
 	/* the least recently used item is kept at lru->prev */
 	struct list_head lru;
 	struct list_head free;
 	struct list_head in_use;
 	struct list_head to_be_changed;
+	/* changes of a transaction in flight, see lc_start_commit() */
+	struct list_head committing;
 
 	/* the pre-created kmem cache to allocate the objects from */
 	struct kmem_cache *lc_cache;
@@ -239,6 +247,13 @@ struct lru_cache {
 	/* number of elements currently on to_be_changed list */
 	unsigned int pending_changes;
 
+	/* Soft limit on the size of the active set, at most nr_elements.
+	 * Free elements are only used while fewer than max_active are active,
+	 * unless there is nothing to evict; lc_shrink() gives back the excess. */
+	unsigned int max_active;
+	/* number of elements in the active set, including pending changes */
+	unsigned int active;
+
 	/* statistics */
 	unsigned used; /* number of elements currently on in_use list */
 	unsigned long hits, misses, starving, locked, changed;
@@ -253,6 +268,13 @@ struct lru_cache {
 	/* nr_elements there */
 	struct hlist_head *lc_slot;
 	struct lc_element **lc_element;
+
+	/* Committed active set, label -> index, linear probing.
+	 * Packed into few cache lines, so the lockless lookup does not need
+	 * to chase lc_element pointers.  1 << lc_index_bits slots,
+	 * at least twice nr_elements.  May be NULL, if allocation failed. */
+	struct lc_index_slot *lc_index_tab;
+	unsigned int lc_index_bits;
 };
 
 
@@ -278,11 +300,16 @@ enum {
 	 * if the statistics say we are frequently starving,
 	 * nr_elements is too small. */
 	__LC_STARVING,
+
+	/* a transaction is in flight, its changes are on the "committing"
+	 * list.  No further transaction may start until lc_finish_commit(). */
+	__LC_COMMITTING,
 };
 #define LC_PARANOIA (1<<__LC_PARANOIA)
 #define LC_DIRTY    (1<<__LC_DIRTY)
 #define LC_LOCKED   (1<<__LC_LOCKED)
 #define LC_STARVING (1<<__LC_STARVING)
+#define LC_COMMITTING (1<<__LC_COMMITTING)
 
 extern struct lru_cache *lc_create(const char *name, struct kmem_cache *cache,
 		unsigned max_pending_changes,
@@ -294,10 +321,14 @@ extern void lc_del(struct lru_cache *lc, struct lc_element *element);
 
 extern struct lc_element *lc_get_cumulative(struct lru_cache *lc, unsigned int enr);
 extern struct lc_element *lc_try_get(struct lru_cache *lc, unsigned int enr);
+extern struct lc_element *lc_try_get_lockless(struct lru_cache *lc, unsigned int enr);
 extern struct lc_element *lc_find(struct lru_cache *lc, unsigned int enr);
 extern struct lc_element *lc_get(struct lru_cache *lc, unsigned int enr);
 extern unsigned int lc_put(struct lru_cache *lc, struct lc_element *e);
 extern void lc_committed(struct lru_cache *lc);
+extern struct lc_element *lc_shrink(struct lru_cache *lc);
+extern void lc_start_commit(struct lru_cache *lc);
+extern void lc_finish_commit(struct lru_cache *lc);
 
 struct seq_file;
 extern size_t lc_seq_printf_stats(struct seq_file *seq, struct lru_cache *lc);
@@ -312,10 +343,17 @@ extern void lc_seq_dump_details(struct seq_file *seq, struct lru_cache *lc, char
  * Allows (expects) the set to be "dirty".  Note that the reference counts and
  * order on the active and lru lists may still change.  Used to serialize
  * changing transactions.  Returns true if we aquired the lock.
+ * Fails as long as a previous transaction is in flight, see lc_start_commit().
  */
 static inline int lc_try_lock_for_transaction(struct lru_cache *lc)
 {
-	return !test_and_set_bit(__LC_LOCKED, &lc->flags);
+	if (test_and_set_bit(__LC_LOCKED, &lc->flags))
+		return 0;
+	if (test_bit(__LC_COMMITTING, &lc->flags)) {
+		clear_bit_unlock(__LC_LOCKED, &lc->flags);
+		return 0;
+	}
+	return 1;
 }
 
 /**
@@ -28,6 +28,8 @@
 #include <linux/slab.h>
 #include <linux/string.h> /* for memset */
 #include <linux/seq_file.h> /* for seq_printf */
+#include <linux/hash.h>
+#include <linux/log2.h>
 #include <linux/lru_cache.h>
 #include "drbd_wrappers.h"
 
@@ -98,6 +100,8 @@ struct lru_cache *lc_create(const char *name, struct kmem_cache *cache,
 {
 	struct hlist_head *slot = NULL;
 	struct lc_element **element = NULL;
+	struct lc_index_slot *index_tab;
+	unsigned int index_bits;
 	struct lru_cache *lc;
 	struct lc_element *e;
 	unsigned cache_obj_size = kmem_cache_size(cache);
@@ -123,15 +127,29 @@ struct lru_cache *lc_create(const char *name, struct kmem_cache *cache,
 	if (!lc)
 		goto out_fail;
 
+	/* The lockless index is an optimization only; do without it,
+	 * should that (possibly higher order) allocation fail. */
+	index_bits = ilog2(roundup_pow_of_two(2 * e_count));
+	index_tab = kmalloc(sizeof(struct lc_index_slot) << index_bits,
+			    GFP_KERNEL | __GFP_NOWARN);
+	if (index_tab) {
+		lc->lc_index_tab = index_tab;
+		lc->lc_index_bits = index_bits;
+		for (i = 0; i < 1U << index_bits; i++)
+			index_tab[i].enr = LC_FREE;
+	}
+
 	INIT_LIST_HEAD(&lc->in_use);
 	INIT_LIST_HEAD(&lc->lru);
 	INIT_LIST_HEAD(&lc->free);
 	INIT_LIST_HEAD(&lc->to_be_changed);
+	INIT_LIST_HEAD(&lc->committing);
 
 	lc->name = name;
 	lc->element_size = e_size;
 	lc->element_off = e_off;
 	lc->nr_elements = e_count;
+	lc->max_active = e_count;
 	lc->max_pending_changes = max_pending_changes;
 	lc->lc_cache = cache;
 	lc->lc_element = element;
@@ -158,6 +176,7 @@ struct lru_cache *lc_create(const char *name, struct kmem_cache *cache,
 		void *p = element[i];
 		kmem_cache_free(cache, p - e_off);
 	}
+	kfree(lc->lc_index_tab);
 	kfree(lc);
 out_fail:
 	kfree(element);
@@ -188,6 +207,7 @@ void lc_destroy(struct lru_cache *lc)
 		lc_free_by_index(lc, i);
 	kfree(lc->lc_element);
 	kfree(lc->lc_slot);
+	kfree(lc->lc_index_tab);
 	kfree(lc);
 }
 
@@ -206,6 +226,7 @@ void lc_reset(struct lru_cache *lc)
 	INIT_LIST_HEAD(&lc->lru);
 	INIT_LIST_HEAD(&lc->free);
 	INIT_LIST_HEAD(&lc->to_be_changed);
+	INIT_LIST_HEAD(&lc->committing);
 	lc->used = 0;
 	lc->hits = 0;
 	lc->misses = 0;
@@ -213,8 +234,14 @@ void lc_reset(struct lru_cache *lc)
 	lc->locked = 0;
 	lc->changed = 0;
 	lc->pending_changes = 0;
+	lc->max_active = lc->nr_elements;
+	lc->active = 0;
 	lc->flags = 0;
 	memset(lc->lc_slot, 0, sizeof(struct hlist_head) * lc->nr_elements);
+	if (lc->lc_index_tab) {
+		for (i = 0; i < 1U << lc->lc_index_bits; i++)
+			lc->lc_index_tab[i].enr = LC_FREE;
+	}
 
 	for (i = 0; i < lc->nr_elements; i++) {
 		struct lc_element *e = lc->lc_element[i];
@@ -254,6 +281,73 @@ static struct hlist_head *lc_hash_slot(struct lru_cache *lc, unsigned int enr)
 	return  lc->lc_slot + (enr % lc->nr_elements);
 }
 
+/* The lockless index only knows about committed labels.  It is modified
+ * under the same (user provided) lock as the rest of the lru_cache;
+ * readers in lc_try_get_lockless() may see it in transition, and then
+ * either miss an entry, or find a stale one, which they verify against
+ * the element itself. */
+static void lc_index_add(struct lru_cache *lc, struct lc_element *e)
+{
+	struct lc_index_slot *tab = lc->lc_index_tab;
+	unsigned int mask = (1U << lc->lc_index_bits) - 1;
+	unsigned int i;
+
+	if (!tab || e->lc_number == LC_FREE)
+		return;
+
+	/* Never full: at least twice as many slots as elements. */
+	i = hash_32(e->lc_number, lc->lc_index_bits);
+	while (tab[i].enr != LC_FREE)
+		i = (i + 1) & mask;
+	tab[i].index = e->lc_index;
+	smp_wmb();
+	ACCESS_ONCE(tab[i].enr) = e->lc_number;
+}
+
+static void lc_index_del(struct lru_cache *lc, struct lc_element *e)
+{
+	struct lc_index_slot *tab = lc->lc_index_tab;
+	unsigned int mask = (1U << lc->lc_index_bits) - 1;
+	unsigned int i, j, k;
+
+	if (!tab || e->lc_number == LC_FREE)
+		return;
+
+	i = hash_32(e->lc_number, lc->lc_index_bits);
+	while (tab[i].enr != e->lc_number) {
+		if (tab[i].enr == LC_FREE)
+			return;
+		i = (i + 1) & mask;
+	}
+
+	/* Backward shift deletion: move up any later entry of this cluster
+	 * that would no longer be reachable from its home slot. */
+	for (j = (i + 1) & mask; tab[j].enr != LC_FREE; j = (j + 1) & mask) {
+		k = hash_32(tab[j].enr, lc->lc_index_bits);
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		tab[i].index = tab[j].index;
+		smp_wmb();
+		ACCESS_ONCE(tab[i].enr) = tab[j].enr;
+		i = j;
+	}
+	ACCESS_ONCE(tab[i].enr) = LC_FREE;
+}
+
+/* Reference counts of elements may be increased by lc_try_get_lockless()
+ * without holding the lock, so all other changes need to be atomic as well. */
+static unsigned int lc_ref_add(struct lc_element *e, int delta)
+{
+	unsigned int old, val;
+
+	val = ACCESS_ONCE(e->refcnt);
+	do {
+		old = val;
+		val = cmpxchg(&e->refcnt, old, old + delta);
+	} while (val != old);
+	return old + delta;
+}
+
 
 static struct lc_element *__lc_find(struct lru_cache *lc, unsigned int enr,
 		bool include_changing)
@@ -321,6 +415,9 @@ void lc_del(struct lru_cache *lc, struct lc_element *e)
 	PARANOIA_LC_ELEMENT(lc, e);
 	BUG_ON(e->refcnt);
 
+	lc_index_del(lc, e);
+	if (e->lc_number != LC_FREE)
+		lc->active--;
 	e->lc_number = e->lc_new_number = LC_FREE;
 	hlist_del_init(&e->colision);
 	list_move(&e->list, &lc->free);
@@ -332,9 +429,13 @@ static struct lc_element *lc_prepare_for_change(struct lru_cache *lc, unsigned n
 	struct list_head *n;
 	struct lc_element *e;
 
-	if (!list_empty(&lc->free))
+	/* Grow the active set only up to max_active;
+	 * beyond that, prefer to recycle the least recently used element. */
+	if (!list_empty(&lc->free) &&
+	    (lc->active < lc->max_active || list_empty(&lc->lru))) {
 		n = lc->free.next;
-	else if (!list_empty(&lc->lru))
+		lc->active++;
+	} else if (!list_empty(&lc->lru))
 		n = lc->lru.prev;
 	else
 		return NULL;
@@ -342,6 +443,8 @@ static struct lc_element *lc_prepare_for_change(struct lru_cache *lc, unsigned n
 	e = list_entry(n, struct lc_element, list);
 	PARANOIA_LC_ELEMENT(lc, e);
 
+	/* the old label is no longer valid once it is about to be changed */
+	lc_index_del(lc, e);
 	e->lc_new_number = new_number;
 	if (!hlist_unhashed(&e->colision))
 		__hlist_del(&e->colision);
@@ -392,13 +495,13 @@ static struct lc_element *__lc_get(struct lru_cache *lc, unsigned int enr, unsig
 				RETURN(NULL);
 			/* ... unless the caller is aware of the implications,
 			 * probably preparing a cumulative transaction. */
-			++e->refcnt;
+			lc_ref_add(e, 1);
 			++lc->hits;
 			RETURN(e);
 		}
 		/* else: lc_new_number == lc_number; a real hit. */
 		++lc->hits;
-		if (e->refcnt++ == 0)
+		if (lc_ref_add(e, 1) == 1)
 			lc->used++;
 		list_move(&e->list, &lc->in_use); /* Not evictable... */
 		RETURN(e);
@@ -439,7 +542,7 @@ static struct lc_element *__lc_get(struct lru_cache *lc, unsigned int enr, unsig
 	BUG_ON(!e);
 
 	clear_bit(__LC_STARVING, &lc->flags);
-	BUG_ON(++e->refcnt != 1);
+	BUG_ON(lc_ref_add(e, 1) != 1);
 	lc->used++;
 	lc->pending_changes++;
 
@@ -532,6 +635,88 @@ struct lc_element *lc_try_get(struct lru_cache *lc, unsigned int enr)
 	return __lc_get(lc, enr, 0);
 }
 
+/**
+ * lc_try_get_lockless - get element by label, if it is in use already
+ * @lc: the lru cache to operate on
+ * @enr: the label to look up
+ *
+ * Like lc_try_get(), but may be called without holding the lock that
+ * otherwise serializes access to @lc.  It only handles the "already in
+ * use, increase the usage count" case: it does not touch the lru list,
+ * and does not account hits or misses.
+ *
+ * Users of it need to change the refcnt of elements of @lc only through
+ * the lru_cache functions.
+ *
+ * Return values:
+ *  NULL
+ *     The label was not found committed and in use, or @lc is %LC_STARVING.
+ *     Retry with lc_try_get() or lc_get(), with the lock held.
+ *
+ *  pointer to the element with the REQUESTED element number.
+ *
+ *  pointer to an element with lc_new_number != @enr.
+ *     It changed its label while we took the reference, and this was the
+ *     last one, so it could not be dropped without the lock.
+ *     The caller needs to lc_put() it under the lock, and retry.
+ */
+struct lc_element *lc_try_get_lockless(struct lru_cache *lc, unsigned int enr)
+{
+	struct lc_index_slot *tab = ACCESS_ONCE(lc->lc_index_tab);
+	unsigned int mask = (1U << lc->lc_index_bits) - 1;
+	struct lc_element *e = NULL;
+	unsigned int i, n, old, val;
+
+	if (!tab || test_bit(__LC_STARVING, &lc->flags))
+		return NULL;
+
+	i = hash_32(enr, lc->lc_index_bits);
+	for (n = 0; n <= mask; n++, i = (i + 1) & mask) {
+		unsigned int slot_enr = ACCESS_ONCE(tab[i].enr);
+
+		if (slot_enr == LC_FREE)
+			return NULL;
+		if (slot_enr == enr) {
+			unsigned int index;
+
+			smp_rmb();
+			index = ACCESS_ONCE(tab[i].index);
+			if (index < lc->nr_elements)
+				e = lc->lc_element[index];
+			break;
+		}
+	}
+	if (!e)
+		return NULL;
+
+	/* Only ever go from in use to "more" in use. Transitions from and
+	 * to refcnt == 0 move the element between lists, and need the lock. */
+	val = ACCESS_ONCE(e->refcnt);
+	do {
+		old = val;
+		if (old == 0 ||
+		    ACCESS_ONCE(e->lc_number) != enr ||
+		    ACCESS_ONCE(e->lc_new_number) != enr)
+			return NULL;
+		val = cmpxchg(&e->refcnt, old, old + 1);
+	} while (val != old);
+
+	/* cmpxchg() implies a full barrier.  Labels do not change while
+	 * the refcnt is > 0, unless the element got recycled in between. */
+	if (likely(ACCESS_ONCE(e->lc_number) == enr &&
+		   ACCESS_ONCE(e->lc_new_number) == enr))
+		return e;
+
+	val = ACCESS_ONCE(e->refcnt);
+	do {
+		old = val;
+		if (old == 1)
+			return e;
+		val = cmpxchg(&e->refcnt, old, old - 1);
+	} while (val != old);
+	return NULL;
+}
+
 /**
  * lc_committed - tell @lc that pending changes have been recorded
  * @lc: the lru cache to operate on
@@ -549,12 +734,95 @@ void lc_committed(struct lru_cache *lc)
 		/* count number of changes, not number of transactions */
 		++lc->changed;
 		e->lc_number = e->lc_new_number;
-		list_move(&e->list, &lc->in_use);
+		lc_index_add(lc, e);
+		/* given back by lc_shrink() */
+		if (e->lc_number == LC_FREE)
+			list_move(&e->list, &lc->free);
+		else
+			list_move(&e->list, &lc->in_use);
 	}
 	lc->pending_changes = 0;
 	RETURN();
 }
 
+/**
+ * lc_shrink - give back one unused element beyond max_active
+ * @lc: the lru cache to operate on
+ *
+ * Must be called with the transaction lock held (lc_try_lock_for_transaction()).
+ * Schedules the least recently used element to become free with the next
+ * transaction.  Like for lc_get(), the change is accounted in
+ * pending_changes, and the element is moved to the "to_be_changed" list,
+ * with lc_new_number %LC_FREE.  It is no longer found by lc_find().
+ *
+ * Returns the element, with lc_number still its old label,
+ * or NULL if there is nothing to give back, or no more room in this transaction.
+ */
+struct lc_element *lc_shrink(struct lru_cache *lc)
+{
+	struct lc_element *e;
+
+	PARANOIA_ENTRY();
+	if (lc->active <= lc->max_active || list_empty(&lc->lru) ||
+	    lc->pending_changes >= lc->max_pending_changes)
+		RETURN(NULL);
+
+	e = list_entry(lc->lru.prev, struct lc_element, list);
+	PARANOIA_LC_ELEMENT(lc, e);
+	BUG_ON(e->refcnt);
+
+	lc_index_del(lc, e);
+	hlist_del_init(&e->colision);
+	e->lc_new_number = LC_FREE;
+	list_move(&e->list, &lc->to_be_changed);
+	lc->active--;
+	lc->pending_changes++;
+	RETURN(e);
+}
+
+/**
+ * lc_start_commit - the pending changes are about to be recorded
+ * @lc: the lru cache to operate on
+ *
+ * Like lc_committed(), but for users that want to accumulate the changes
+ * of the next transaction while the current one is still being written.
+ * Must be called with the transaction lock held (lc_try_lock_for_transaction()),
+ * which may be dropped afterwards.  The elements stay unusable for lc_get()
+ * until lc_finish_commit(); until then no other transaction can start.
+ */
+void lc_start_commit(struct lru_cache *lc)
+{
+	PARANOIA_ENTRY();
+	BUG_ON(!list_empty(&lc->committing));
+	list_splice_init(&lc->to_be_changed, &lc->committing);
+	lc->pending_changes = 0;
+	set_bit(__LC_COMMITTING, &lc->flags);
+	RETURN();
+}
+
+/**
+ * lc_finish_commit - tell @lc that the changes from lc_start_commit() have been recorded
+ * @lc: the lru cache to operate on
+ */
+void lc_finish_commit(struct lru_cache *lc)
+{
+	struct lc_element *e, *tmp;
+
+	PARANOIA_ENTRY();
+	list_for_each_entry_safe(e, tmp, &lc->committing, list) {
+		++lc->changed;
+		e->lc_number = e->lc_new_number;
+		lc_index_add(lc, e);
+		/* given back by lc_shrink() */
+		if (e->lc_number == LC_FREE)
+			list_move(&e->list, &lc->free);
+		else
+			list_move(&e->list, &lc->in_use);
+	}
+	clear_bit_unlock(__LC_COMMITTING, &lc->flags);
+	RETURN();
+}
+
 
 /**
  * lc_put - give up refcnt of @e
@@ -567,17 +835,20 @@ void lc_committed(struct lru_cache *lc)
  */
 unsigned int lc_put(struct lru_cache *lc, struct lc_element *e)
 {
+	unsigned int refcnt;
+
 	PARANOIA_ENTRY();
 	PARANOIA_LC_ELEMENT(lc, e);
 	BUG_ON(e->refcnt == 0);
 	BUG_ON(e->lc_number != e->lc_new_number);
-	if (--e->refcnt == 0) {
+	refcnt = lc_ref_add(e, -1);
+	if (refcnt == 0) {
 		/* move it to the front of LRU. */
 		list_move(&e->list, &lc->lru);
 		lc->used--;
 		clear_bit_unlock(__LC_STARVING, &lc->flags);
 	}
-	RETURN(e->refcnt);
+	RETURN(refcnt);
 }
 
 /**
@@ -624,7 +895,13 @@ void lc_set(struct lru_cache *lc, unsigned int enr, int index)
 	BUG_ON(e->lc_number != e->lc_new_number);
 	BUG_ON(e->refcnt != 0);
 
+	lc_index_del(lc, e);
+	if (e->lc_number != LC_FREE)
+		lc->active--;
+	if (enr != LC_FREE)
+		lc->active++;
 	e->lc_number = e->lc_new_number = enr;
+	lc_index_add(lc, e);
 	hlist_del_init(&e->colision);
 	if (enr == LC_FREE)
 		lh = &lc->free;